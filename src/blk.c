@@ -0,0 +1,376 @@
+/*
+ * LiME - Linux Memory Extractor
+ * Copyright (c) 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ *
+ * Author:
+ * Joe T. Sylve, Ph.D.       - joe.sylve@gmail.com, @jtsylve
+ *
+ * SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "lime.h"
+
+#ifdef LIME_SUPPORTS_BLK
+
+/*
+ * Raw block device output.
+ *
+ * The device is claimed exclusively and written from sector 0 with bios
+ * built straight from a ring of LIME_CHUNK_SIZE buffers, bypassing any
+ * filesystem and the block device page cache.  A full buffer goes out
+ * as one multi-page bio and the next buffer takes over; a buffer is
+ * reused once its bio completes, so up to nbbufs bios are in flight.
+ * The buffers are vmalloc()ed, so on architectures with aliasing
+ * caches they are flushed before each bio goes out.
+ *
+ * With bufsize=, main.c hands over whole staging buffers instead: their
+ * own pages go into the bios, with no copy, and a buffer is only filled
+ * again once release_stage_blk() has seen its bios complete.  Only a
+ * tail shorter than a logical block goes through the ring.
+ */
+
+#define LIME_BLK_STAGES 2
+
+struct lime_bbuf {
+    void *buf;
+    size_t len;
+    struct completion done;
+    int err;
+    int busy;
+};
+
+/* A staging buffer whose pages are in flight. */
+struct lime_bstage {
+    const void *buf;
+    atomic_t pending;       /* bios in flight, plus one while submitting */
+    struct completion done;
+    int err;
+};
+
+static struct file *bf = NULL;
+static struct block_device *bdev;
+static struct lime_bbuf *bbufs;
+static int nbbufs;
+static int cur;
+static loff_t blk_pos;
+static int blk_err;
+static struct lime_bstage bstages[LIME_BLK_STAGES];
+
+static void blk_end_io(struct bio *bio) {
+    struct lime_bbuf *b = bio->bi_private;
+
+    b->err = blk_status_to_errno(bio->bi_status);
+    bio_put(bio);
+    complete(&b->done);
+}
+
+static void blk_stage_end_io(struct bio *bio) {
+    struct lime_bstage *s = bio->bi_private;
+    int err = blk_status_to_errno(bio->bi_status);
+
+    if (err)
+        s->err = err;
+    bio_put(bio);
+
+    if (atomic_dec_and_test(&s->pending))
+        complete(&s->done);
+}
+
+/* Wait for a buffer's bio to finish and note any failure. */
+static void blk_wait(struct lime_bbuf *b) {
+    if (!b->busy)
+        return;
+
+    wait_for_completion(&b->done);
+    b->busy = 0;
+    b->len = 0;
+
+    if (b->err) {
+        DBG("Block write error: %d", b->err);
+        blk_err = b->err;
+    }
+}
+
+/* A write bio for len bytes of page-aligned vmalloc memory at blk_pos. */
+static struct bio *blk_bio(const void *buf, size_t len, bio_end_io_t *end_io, void *private) {
+    unsigned int npages = DIV_ROUND_UP(len, PAGE_SIZE);
+    unsigned int i, n;
+    struct bio *bio;
+
+    bio = bio_alloc(bdev, npages, REQ_OP_WRITE, GFP_KERNEL);
+    bio->bi_iter.bi_sector = blk_pos >> SECTOR_SHIFT;
+    bio->bi_end_io = end_io;
+    bio->bi_private = private;
+
+    for (i = 0; i < npages; i++) {
+        n = min_t(size_t, len - i * PAGE_SIZE, PAGE_SIZE);
+        if (bio_add_page(bio, vmalloc_to_page((const u8 *) buf + i * PAGE_SIZE), n, 0) != n) {
+            bio_put(bio);
+            return NULL;
+        }
+    }
+
+    return bio;
+}
+
+static int blk_submit(struct lime_bbuf *b) {
+    struct bio *bio;
+
+    if (blk_pos + b->len > bdev_nr_bytes(bdev)) {
+        DBG("Block device full at %lld bytes", (long long) blk_pos);
+        return -ENOSPC;
+    }
+
+    bio = blk_bio(b->buf, b->len, blk_end_io, b);
+    if (!bio)
+        return -EIO;
+
+    reinit_completion(&b->done);
+    b->busy = 1;
+    blk_pos += b->len;
+
+    // The device reads the pages, not the vmalloc alias they were filled through
+    flush_kernel_vmap_range(b->buf, b->len);
+
+    submit_bio(bio);
+
+    return 0;
+}
+
+/* Wait for a staging buffer's bios to finish and note any failure. */
+static void blk_stage_wait(struct lime_bstage *s) {
+    if (!s->buf)
+        return;
+
+    wait_for_completion(&s->done);
+    s->buf = NULL;
+
+    if (s->err) {
+        DBG("Block write error: %d", s->err);
+        blk_err = s->err;
+    }
+}
+
+int setup_blk(char *dev) {
+    int i, err;
+
+    bdev = NULL;
+
+    // O_EXCL on a block device claims it exclusively
+    bf = filp_open(dev, O_WRONLY | O_EXCL | O_LARGEFILE, 0);
+    if (!bf || IS_ERR(bf)) {
+        DBG("Error opening block device %ld", PTR_ERR(bf));
+        err = (bf) ? PTR_ERR(bf) : -EIO;
+        bf = NULL;
+        return err;
+    }
+
+    if (!S_ISBLK(file_inode(bf)->i_mode)) {
+        DBG("%s is not a block device", dev);
+        cleanup_blk();
+        return -ENOTBLK;
+    }
+
+    bdev = I_BDEV(bf->f_mapping->host);
+
+    nbbufs = (dio_depth > 0) ? min(dio_depth, LIME_MAX_DIO_DEPTH) : LIME_BLK_DEPTH;
+    bbufs = kcalloc(nbbufs, sizeof(*bbufs), GFP_KERNEL);
+    if (!bbufs)
+        goto nomem;
+
+    for (i = 0; i < nbbufs; i++) {
+        bbufs[i].buf = vmalloc(LIME_CHUNK_SIZE);
+        if (!bbufs[i].buf)
+            goto nomem;
+
+        init_completion(&bbufs[i].done);
+    }
+
+    for (i = 0; i < LIME_BLK_STAGES; i++) {
+        bstages[i].buf = NULL;
+        init_completion(&bstages[i].done);
+    }
+
+    cur = 0;
+    blk_pos = 0;
+    blk_err = 0;
+
+    DBG("Writing to %s with %d bios in flight", dev, nbbufs);
+
+    return 0;
+
+nomem:
+    cleanup_blk();
+    return -ENOMEM;
+}
+
+/*
+ * Complete all outstanding bios.  The tail is padded with zeros to the
+ * logical block size, the only granularity the device accepts.
+ */
+static int blk_flush(void) {
+    struct lime_bbuf *b = &bbufs[cur];
+    size_t len;
+    int i;
+
+    if (!blk_err && b->len) {
+        len = round_up(b->len, bdev_logical_block_size(bdev));
+        memset((u8 *) b->buf + b->len, 0, len - b->len);
+        b->len = len;
+        blk_err = blk_submit(b);
+    }
+
+    for (i = 0; i < nbbufs; i++)
+        blk_wait(&bbufs[i]);
+    for (i = 0; i < LIME_BLK_STAGES; i++)
+        blk_stage_wait(&bstages[i]);
+
+    if (blk_err)
+        return blk_err;
+
+    return blkdev_issue_flush(bdev);
+}
+
+/* Release the device; returns an error if buffered output could not be written. */
+int cleanup_blk(void) {
+    int i, err = 0;
+
+    if (bbufs) {
+        if ((err = blk_flush()) < 0)
+            DBG("Error flushing block device");
+
+        for (i = 0; i < nbbufs; i++)
+            vfree(bbufs[i].buf);
+        kfree(bbufs);
+        bbufs = NULL;
+    }
+
+    // Drop anything cached from before the dump
+    if (bdev) {
+        invalidate_bdev(bdev);
+        bdev = NULL;
+    }
+
+    if (bf) {
+        filp_close(bf, NULL);
+        bf = NULL;
+    }
+
+    return err;
+}
+
+ssize_t write_vaddr_blk(void *v, size_t is) {
+    struct lime_bbuf *b;
+    size_t n, done = 0;
+    int err;
+
+    while (done < is) {
+        b = &bbufs[cur];
+        blk_wait(b);
+        if (blk_err)
+            return blk_err;
+
+        n = min(is - done, LIME_CHUNK_SIZE - b->len);
+        memcpy((u8 *) b->buf + b->len, (u8 *) v + done, n);
+        b->len += n;
+        done += n;
+
+        if (b->len == LIME_CHUNK_SIZE) {
+            if ((err = blk_submit(b)) < 0)
+                return blk_err = err;
+            cur = (cur + 1) % nbbufs;
+        }
+    }
+
+    return is;
+}
+
+/*
+ * Write a staging buffer with bios on its own pages.  The buffer must
+ * not change until release_stage_blk() returns for it.  Buffers that do
+ * not start a block at a page boundary are copied as usual.
+ */
+ssize_t write_stage_blk(void *v, size_t is) {
+    struct lime_bstage *s = NULL;
+    size_t len, off, n;
+    struct bio *bio;
+    int i;
+
+    len = round_down(is, bdev_logical_block_size(bdev));
+
+    for (i = 0; i < LIME_BLK_STAGES && !s; i++)
+        if (!bstages[i].buf)
+            s = &bstages[i];
+
+    if (!s || !len || bbufs[cur].len || offset_in_page(v) || !is_vmalloc_addr(v))
+        return write_vaddr_blk(v, is);
+
+    if (blk_err)
+        return blk_err;
+
+    if (blk_pos + len > bdev_nr_bytes(bdev)) {
+        DBG("Block device full at %lld bytes", (long long) blk_pos);
+        return blk_err = -ENOSPC;
+    }
+
+    s->buf = v;
+    s->err = 0;
+    atomic_set(&s->pending, 1);
+    reinit_completion(&s->done);
+
+    // The device reads the pages, not the vmalloc alias they were filled through
+    flush_kernel_vmap_range(v, len);
+
+    for (off = 0; off < len; off += n) {
+        n = min_t(size_t, len - off, LIME_CHUNK_SIZE);
+        bio = blk_bio((u8 *) v + off, n, blk_stage_end_io, s);
+        if (!bio) {
+            blk_err = -EIO;
+            break;
+        }
+
+        atomic_inc(&s->pending);
+        blk_pos += n;
+        submit_bio(bio);
+    }
+
+    if (atomic_dec_and_test(&s->pending))
+        complete(&s->done);
+
+    if (blk_err)
+        return blk_err;
+
+    // Less than a block is left; it waits in the ring for the rest of it
+    if (is > len && write_vaddr_blk((u8 *) v + len, is - len) < 0)
+        return blk_err;
+
+    return is;
+}
+
+/* Wait until the bios on a buffer given to write_stage_blk() are done. */
+int release_stage_blk(void *v) {
+    int i;
+
+    for (i = 0; i < LIME_BLK_STAGES; i++)
+        if (bstages[i].buf == v)
+            blk_stage_wait(&bstages[i]);
+
+    return blk_err;
+}
+
+#endif
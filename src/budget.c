@@ -0,0 +1,304 @@
+/*
+ * LiME - Linux Memory Extractor
+ * Copyright (c) 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ *
+ * Author:
+ * Joe T. Sylve, Ph.D.       - joe.sylve@gmail.com, @jtsylve
+ *
+ * SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+
+#include "lime.h"
+
+#ifdef LIME_SUPPORTS_TIMING
+
+/*
+ * Read latency budget and skip map.
+ *
+ * Each LIME_CHUNK_SIZE chunk of a range gets timeout milliseconds.  The
+ * monotonic clock is read when a chunk starts and every
+ * LIME_BUDGET_STRIDE pages after that, so a fast chunk costs a handful
+ * of clock reads.  A chunk that runs over has its remaining pages
+ * padded, and each further slow chunk in a row doubles the distance
+ * skipped, up to LIME_MAX_BACKOFF chunks; one chunk read within budget
+ * resets it.  Everything skipped is recorded and written next to the
+ * image as <path>.skip, one "0x<start> 0x<end>" line per region.  With
+ * retry=1 the regions are read again once the dump is complete and
+ * written over their padding.
+ *
+ * Only reading counts.  Output work done by the thread that reads -
+ * digest, compression, the sink and their back-pressure - is bracketed
+ * by budget_stall_begin() and budget_stall_end(), and throttle sleeps
+ * outside those are reported through budget_stall(); either pushes the
+ * deadline back.  Reader threads only read, so their budgets ignore
+ * stalls, which belong to the writer.
+ */
+
+struct skip_entry {
+    resource_size_t addr;
+    resource_size_t len;
+    long long off;
+};
+
+static struct skip_entry *skips;
+static unsigned int nskips;
+static unsigned int maxskips;
+static DEFINE_SPINLOCK(skip_lock);
+
+/* Nanoseconds spent not reading, summed over every thread */
+static atomic64_t stalled = ATOMIC64_INIT(0);
+
+/* Output work in progress in the dumping thread, and when it began */
+static int stall_depth;
+static u64 stall_start;
+
+/* Note ns spent not reading memory, so that budgets do not count it. */
+void budget_stall(u64 ns) {
+    // Sleeps inside bracketed output work are already timed
+    if (!READ_ONCE(stall_depth))
+        atomic64_add(ns, &stalled);
+}
+
+/* Start output work in the dumping thread; pairs may nest. */
+void budget_stall_begin(void) {
+    if (timeout > 0 && !stall_depth++)
+        stall_start = ktime_to_ns(ktime_get());
+}
+
+void budget_stall_end(void) {
+    if (timeout > 0 && !--stall_depth)
+        atomic64_add(ktime_to_ns(ktime_get()) - stall_start, &stalled);
+}
+
+resource_size_t budget_check(struct lime_budget *b, resource_size_t addr) {
+    u64 now, st;
+
+    if (timeout <= 0) {
+        b->next = (resource_size_t) -1;
+        return 0;
+    }
+
+    if (addr < b->skip_end)
+        return b->skip_end - addr;
+
+    now = ktime_to_ns(ktime_get());
+    st = atomic64_read(&stalled);
+
+    if (addr >= b->next) {
+        // A chunk that was read within budget ends the backoff
+        if (!b->late)
+            b->slow = 0;
+        b->late = 0;
+        b->pages = 0;
+        b->next = round_down(addr, LIME_CHUNK_SIZE) + LIME_CHUNK_SIZE;
+        b->deadline = now + (u64) timeout * NSEC_PER_MSEC;
+        b->resumes = lime_resumes();
+        b->stalled = st;
+        return 0;
+    }
+
+    // Output work and throttle sleeps push the deadline back
+    if (!b->reader)
+        b->deadline += st - b->stalled;
+    b->stalled = st;
+
+    // Time spent paused does not count against the budget
+    if (unlikely(b->resumes != lime_resumes())) {
+        b->deadline = now + (u64) timeout * NSEC_PER_MSEC;
+        b->resumes = lime_resumes();
+        return 0;
+    }
+
+    if (now <= b->deadline)
+        return 0;
+
+    if ((1U << b->slow) <= LIME_MAX_BACKOFF)
+        b->slow++;
+    b->late = 1;
+    b->skip_end = b->next + ((resource_size_t) (1U << (b->slow - 1)) - 1) * LIME_CHUNK_SIZE;
+    b->next = b->skip_end;
+
+    DBG("Reading is too slow at 0x%llx, skipping to 0x%llx", (unsigned long long) addr,
+        (unsigned long long) b->skip_end);
+
+    return b->skip_end - addr;
+}
+
+/*
+ * Note len bytes at addr that were padded instead of read.  off is where
+ * the padding starts in the output, or -1 if it cannot be rewritten.
+ * Reader threads call this concurrently.
+ */
+void skipmap_add(resource_size_t addr, resource_size_t len, long long off) {
+    struct skip_entry *e;
+    unsigned int n;
+
+    spin_lock(&skip_lock);
+
+    e = (nskips) ? &skips[nskips - 1] : NULL;
+    if (e && e->addr + e->len == addr && (e->off < 0) == (off < 0) &&
+        (off < 0 || e->off + (long long) e->len == off)) {
+        e->len += len;
+        goto out;
+    }
+
+    if (nskips == maxskips) {
+        n = maxskips ? maxskips * 2 : 64;
+        e = krealloc(skips, n * sizeof(*e), GFP_ATOMIC);
+        if (!e) {
+            DBG("Skip map full, 0x%llx - 0x%llx not recorded", (unsigned long long) addr,
+                (unsigned long long) (addr + len - 1));
+            goto out;
+        }
+        skips = e;
+        maxskips = n;
+    }
+
+    e = &skips[nskips++];
+    e->addr = addr;
+    e->len = len;
+    e->off = off;
+
+out:
+    spin_unlock(&skip_lock);
+}
+
+/*
+ * Read the skipped regions again and write them over their padding with
+ * write_at.  Regions that are still too slow stay in the map.
+ */
+void skipmap_retry(ssize_t (*write_at)(void *, size_t, loff_t), void *buf) {
+    struct lime_budget b;
+    struct skip_entry *e;
+    resource_size_t a;
+    unsigned int i;
+    ssize_t n;
+
+    for (i = 0; i < nskips; i++) {
+        e = &skips[i];
+        if (e->off < 0)
+            continue;
+
+        DBG("Retrying 0x%llx - 0x%llx", (unsigned long long) e->addr,
+            (unsigned long long) (e->addr + e->len - 1));
+
+        budget_start(&b, e->addr);
+
+        for (a = e->addr; a + PAGE_SIZE <= e->addr + e->len; a += PAGE_SIZE) {
+            if (lime_checkpoint() || lime_budget(&b, a))
+                break;
+
+            // Partial pages and invalid PFNs were padding anyway
+            if (!lime_pfn_valid(a >> PAGE_SHIFT))
+                continue;
+
+            read_page(buf, a >> PAGE_SHIFT);
+            budget_stall_begin();
+            n = write_at(buf, PAGE_SIZE, e->off + (a - e->addr));
+            budget_stall_end();
+            if (n != PAGE_SIZE) {
+                DBG("Failed to rewrite 0x%llx", (unsigned long long) a);
+                return;
+            }
+            lime_stat_add(padded, -(s64) PAGE_SIZE);
+        }
+
+        if (a + PAGE_SIZE > e->addr + e->len)
+            a = e->addr + e->len;
+
+        e->off += a - e->addr;
+        e->len -= a - e->addr;
+        e->addr = a;
+    }
+}
+
+static int skip_cmp(const void *a, const void *b) {
+    const struct skip_entry *x = a, *y = b;
+
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+int skipmap_empty(void) {
+    unsigned int i;
+
+    for (i = 0; i < nskips; i++)
+        if (skips[i].len)
+            return 0;
+
+    return 1;
+}
+
+static ssize_t skipmap_write(ssize_t (*write)(void *, size_t)) {
+    char line[48];
+    resource_size_t start, end;
+    unsigned int i;
+    ssize_t ret;
+    int len;
+
+    // Readers finish chunks out of order
+    sort(skips, nskips, sizeof(*skips), skip_cmp, NULL);
+
+    for (i = 0; i < nskips; ) {
+        if (!skips[i].len) {
+            i++;
+            continue;
+        }
+
+        start = skips[i].addr;
+        end = start + skips[i].len;
+        for (i++; i < nskips && skips[i].addr <= end; i++)
+            end = max(end, skips[i].addr + skips[i].len);
+
+        len = snprintf(line, sizeof(line), "0x%llx 0x%llx\n", (unsigned long long) start,
+                       (unsigned long long) (end - 1));
+        if ((ret = RETRY_IF_INTERRUPTED(write(line, len))) < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+int skipmap_write_disk(void) {
+    char *p;
+    int ret;
+    int len;
+
+    len = strlen(path) + sizeof(".skip");
+    p = kmalloc(len, GFP_KERNEL);
+    if (!p)
+        return -ENOMEM;
+
+    snprintf(p, len, "%s.skip", path);
+
+    if ((ret = setup_disk(p, 0)) == 0)
+        ret = (skipmap_write(write_vaddr_disk) < 0) ? -EIO : 0;
+
+    cleanup_disk();
+    kfree(p);
+
+    return ret;
+}
+
+void skipmap_clean(void) {
+    kfree(skips);
+    skips = NULL;
+    nskips = maxskips = 0;
+}
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * LiME - Linux Memory Extractor
+ * Copyright (c) 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ *
+ * Author:
+ * Joe T. Sylve, Ph.D.       - joe.sylve@gmail.com, @jtsylve
+ *
+ * SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "lime.h"
+
+#ifdef LIME_SUPPORTS_COMPRESS_THREADS
+
+/*
+ * Chunked compression on a worker pool.
+ *
+ * The output stream is cut into LIME_CHUNK_SIZE pieces and each piece is
+ * compressed independently on an unbound workqueue.  Chunks live in a
+ * ring; before the writer refills a slot it waits for that slot's chunk
+ * and emits it, so compressed chunks leave in the order they came in.
+ * Every codec writes a self-contained frame per chunk (a gzip member, an
+ * LZ4 frame or a zstd frame), so the concatenated output decodes with
+ * the matching command line tool.
+ */
+
+struct lime_codec {
+    int alg;
+    int (*workspacesize)(void);
+    size_t (*bound)(size_t);
+    ssize_t (*compress)(void *, const void *, size_t, void *, size_t);
+};
+
+static const struct lime_codec codecs[] = {
+#ifdef LIME_SUPPORTS_GZIP
+    { LIME_COMPRESS_DEFLATE, deflate_member_workspacesize, deflate_member_bound, deflate_member },
+#endif
+#ifdef LIME_SUPPORTS_LZ4
+    { LIME_COMPRESS_LZ4, lz4_member_workspacesize, lz4_member_bound, lz4_member },
+#endif
+#ifdef LIME_SUPPORTS_LZ4HC
+    { LIME_COMPRESS_LZ4HC, lz4hc_member_workspacesize, lz4_member_bound, lz4hc_member },
+#endif
+#ifdef LIME_SUPPORTS_ZSTD
+    { LIME_COMPRESS_ZSTD, zstd_member_workspacesize, zstd_member_bound, zstd_member },
+#endif
+};
+
+static const struct lime_codec *codec;
+
+struct lime_cchunk {
+    struct work_struct work;
+    struct completion done;
+    void *in;
+    size_t inlen;
+    void *out;
+    ssize_t outlen;
+    void *workspace;
+};
+
+static struct workqueue_struct *cwq;
+static struct lime_cchunk *cchunks;
+static int ncchunks;
+static size_t out_size;
+
+static unsigned long head;  /* chunk being filled */
+static unsigned long tail;  /* oldest chunk not yet emitted */
+
+static void compress_work(struct work_struct *work) {
+    struct lime_cchunk *c = container_of(work, struct lime_cchunk, work);
+
+    c->outlen = codec->compress(c->workspace, c->in, c->inlen, c->out, out_size);
+    complete(&c->done);
+}
+
+int compress_start(int n, int alg) {
+    int i, ws;
+
+    for (codec = NULL, i = 0; i < ARRAY_SIZE(codecs); i++)
+        if (codecs[i].alg == alg)
+            codec = &codecs[i];
+
+    if (!codec) {
+        DBG("Compression algorithm %d not available in this kernel", alg);
+        return -EINVAL;
+    }
+
+    ncchunks = n * 2;
+    out_size = codec->bound(LIME_CHUNK_SIZE);
+    ws = codec->workspacesize();
+
+    DBG("Starting %d compression workers.", n);
+
+    cwq = alloc_workqueue("lime_compress", WQ_UNBOUND, n);
+    cchunks = kcalloc(ncchunks, sizeof(*cchunks), GFP_KERNEL);
+    if (!cwq || !cchunks)
+        goto fail;
+
+    for (i = 0; i < ncchunks; i++) {
+        cchunks[i].in = vmalloc(LIME_CHUNK_SIZE);
+        cchunks[i].out = vmalloc(out_size);
+        cchunks[i].workspace = vmalloc(ws);
+        if (!cchunks[i].in || !cchunks[i].out || !cchunks[i].workspace)
+            goto fail;
+
+        INIT_WORK(&cchunks[i].work, compress_work);
+        init_completion(&cchunks[i].done);
+    }
+
+    head = tail = 0;
+
+    return 0;
+
+fail:
+    DBG("Failed to start compression workers");
+    compress_stop();
+    return -ENOMEM;
+}
+
+void compress_stop(void) {
+    int i;
+
+    if (cwq) {
+        destroy_workqueue(cwq);
+        cwq = NULL;
+    }
+
+    if (cchunks) {
+        for (i = 0; i < ncchunks; i++) {
+            vfree(cchunks[i].in);
+            vfree(cchunks[i].out);
+            vfree(cchunks[i].workspace);
+        }
+        kfree(cchunks);
+        cchunks = NULL;
+    }
+}
+
+/* Wait for the oldest outstanding chunk and hand it to the sink. */
+static ssize_t compress_drain(ssize_t (*emit)(void *, ssize_t)) {
+    struct lime_cchunk *c = &cchunks[tail % ncchunks];
+
+    wait_for_completion(&c->done);
+    tail++;
+    c->inlen = 0;
+
+    if (c->outlen < 0)
+        return c->outlen;
+
+    return emit(c->out, c->outlen);
+}
+
+static ssize_t compress_submit(ssize_t (*emit)(void *, ssize_t)) {
+    struct lime_cchunk *c = &cchunks[head % ncchunks];
+
+    reinit_completion(&c->done);
+    queue_work(cwq, &c->work);
+    head++;
+
+    /* The next slot to fill still holds the oldest chunk. */
+    if (head - tail == ncchunks)
+        return compress_drain(emit);
+
+    return 0;
+}
+
+ssize_t compress_write(const void *v, size_t is, ssize_t (*emit)(void *, ssize_t)) {
+    struct lime_cchunk *c;
+    size_t n, done = 0;
+    ssize_t ret;
+
+    while (done < is) {
+        c = &cchunks[head % ncchunks];
+
+        n = min(is - done, LIME_CHUNK_SIZE - c->inlen);
+        memcpy((u8 *) c->in + c->inlen, (const u8 *) v + done, n);
+        c->inlen += n;
+        done += n;
+
+        if (c->inlen == LIME_CHUNK_SIZE && (ret = compress_submit(emit)) < 0)
+            return ret;
+    }
+
+    return is;
+}
+
+/* End the current chunk early so the next write starts a new member. */
+ssize_t compress_sync(ssize_t (*emit)(void *, ssize_t)) {
+    if (cchunks[head % ncchunks].inlen > 0)
+        return compress_submit(emit);
+
+    return 0;
+}
+
+ssize_t compress_flush(ssize_t (*emit)(void *, ssize_t)) {
+    ssize_t ret, err = 0;
+
+    if ((ret = compress_sync(emit)) < 0)
+        err = ret;
+
+    while (tail < head) {
+        ret = compress_drain(emit);
+        if (ret < 0 && !err)
+            err = ret;
+    }
+
+    return err;
+}
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * LiME - Linux Memory Extractor
+ * Copyright (c) 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ *
+ * Author:
+ * Joe T. Sylve, Ph.D.       - joe.sylve@gmail.com, @jtsylve
+ *
+ * SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "lime.h"
+
+#ifdef LIME_SUPPORTS_CONTROL
+
+/*
+ * Acquisition control through /sys/module/lime/control.
+ *
+ * Reading the file gives the state; writing start, pause, resume or
+ * cancel changes it.  The dump calls lime_checkpoint() between pages
+ * and chunks: while paused it sleeps there, holding no CPU and issuing
+ * no I/O, and once cancelled it returns an error so the loops wind down
+ * and the output is closed as usual.  The sink stays open while paused.
+ *
+ * Without background=1 the dump runs in module_init as before and the
+ * file still works from another shell.  With background=1 it runs in a
+ * kthread that waits for start, and insmod returns at once.
+ */
+
+static const char * const state_names[] = {
+    [LIME_STATE_IDLE] = "idle",
+    [LIME_STATE_RUNNING] = "running",
+    [LIME_STATE_PAUSED] = "paused",
+    [LIME_STATE_CANCELLING] = "cancelling",
+    [LIME_STATE_DONE] = "done",
+    [LIME_STATE_CANCELLED] = "cancelled",
+    [LIME_STATE_FAILED] = "failed",
+};
+
+static int state = LIME_STATE_IDLE;
+static DEFINE_SPINLOCK(state_lock);
+static DECLARE_WAIT_QUEUE_HEAD(state_wait);
+
+/* Times the dump has been resumed, so time budgets can discount pauses. */
+static unsigned long resumes;
+
+static struct task_struct *worker;
+static int (*dump)(void);
+static int have_file;
+
+static int set_state(int from_mask, int to) {
+    int ok;
+
+    spin_lock(&state_lock);
+    ok = (1 << state) & from_mask;
+    if (ok)
+        state = to;
+    spin_unlock(&state_lock);
+
+    if (ok)
+        wake_up_all(&state_wait);
+
+    return ok;
+}
+
+/* Record how the dump ended unless it was cancelled on the way. */
+static void finish(int err) {
+    if (!set_state(1 << LIME_STATE_CANCELLING, LIME_STATE_CANCELLED))
+        set_state(~0, err ? LIME_STATE_FAILED : LIME_STATE_DONE);
+}
+
+int lime_checkpoint(void) {
+    if (likely(READ_ONCE(state) == LIME_STATE_RUNNING))
+        return 0;
+
+    if (READ_ONCE(state) == LIME_STATE_PAUSED) {
+        DBG("Paused");
+        // A signal to insmod while paused cancels the dump
+        if (wait_event_interruptible(state_wait, READ_ONCE(state) != LIME_STATE_PAUSED))
+            set_state(1 << LIME_STATE_PAUSED, LIME_STATE_CANCELLING);
+        WRITE_ONCE(resumes, resumes + 1);
+        DBG("Resumed");
+    }
+
+    return (READ_ONCE(state) == LIME_STATE_CANCELLING) ? -ECANCELED : 0;
+}
+
+int lime_cancelled(void) {
+    return READ_ONCE(state) == LIME_STATE_CANCELLING;
+}
+
+/* Cancel the dump and wake it if it is blocked on a socket. */
+static int cancel(void) {
+    if (!set_state((1 << LIME_STATE_IDLE) | (1 << LIME_STATE_RUNNING) | (1 << LIME_STATE_PAUSED),
+                   LIME_STATE_CANCELLING))
+        return 0;
+
+    abort_tcp();
+    return 1;
+}
+
+unsigned long lime_resumes(void) {
+    return READ_ONCE(resumes);
+}
+
+static ssize_t control_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    return sprintf(buf, "%s\n", state_names[READ_ONCE(state)]);
+}
+
+static ssize_t control_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count) {
+    int ok;
+
+    if (sysfs_streq(buf, "start"))
+        ok = set_state(1 << LIME_STATE_IDLE, LIME_STATE_RUNNING);
+    else if (sysfs_streq(buf, "pause"))
+        ok = set_state(1 << LIME_STATE_RUNNING, LIME_STATE_PAUSED);
+    else if (sysfs_streq(buf, "resume"))
+        ok = set_state(1 << LIME_STATE_PAUSED, LIME_STATE_RUNNING);
+    else if (sysfs_streq(buf, "cancel"))
+        ok = cancel();
+    else
+        return -EINVAL;
+
+    return ok ? count : -EBUSY;
+}
+
+static struct kobj_attribute control_attr = __ATTR(control, 0644, control_show, control_store);
+
+static int worker_thread(void *arg) {
+    wait_event_interruptible(state_wait, kthread_should_stop() || READ_ONCE(state) != LIME_STATE_IDLE);
+
+    if (READ_ONCE(state) == LIME_STATE_RUNNING) {
+        DBG("Starting background dump");
+        finish(dump());
+    } else {
+        finish(0);
+    }
+
+    // kthread_stop() in control_stop() collects the thread
+    while (!kthread_should_stop())
+        wait_event_interruptible(state_wait, kthread_should_stop());
+
+    return 0;
+}
+
+int control_start(int background, int (*fn)(void)) {
+    int err;
+
+    dump = fn;
+    state = background ? LIME_STATE_IDLE : LIME_STATE_RUNNING;
+
+    err = sysfs_create_file(&THIS_MODULE->mkobj.kobj, &control_attr.attr);
+    if (err)
+        DBG("Failed to create control file: %d", err);
+    else
+        have_file = 1;
+
+    if (!background) {
+        err = fn();
+        finish(err);
+        return err;
+    }
+
+    if (!have_file) {
+        DBG("Background dump needs the control file");
+        return err;
+    }
+
+    worker = kthread_run(worker_thread, NULL, "lime");
+    if (IS_ERR(worker)) {
+        err = PTR_ERR(worker);
+        worker = NULL;
+        return err;
+    }
+
+    DBG("Waiting for start in /sys/module/lime/control");
+
+    return 0;
+}
+
+void control_stop(void) {
+    // Unloading mid-dump cancels it; the worker closes the output first
+    cancel();
+
+    if (worker) {
+        kthread_stop(worker);
+        worker = NULL;
+    }
+
+    if (have_file) {
+        sysfs_remove_file(&THIS_MODULE->mkobj.kobj, &control_attr.attr);
+        have_file = 0;
+    }
+}
+
+#endif
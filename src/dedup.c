@@ -0,0 +1,132 @@
+/*
+ * LiME - Linux Memory Extractor
+ * Copyright (c) 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ *
+ * Author:
+ * Joe T. Sylve, Ph.D.       - joe.sylve@gmail.com, @jtsylve
+ *
+ * SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "lime.h"
+
+#ifdef LIME_SUPPORTS_DEDUP
+
+/*
+ * Content-addressed page table for in-dump deduplication.
+ *
+ * Pages written as data are remembered by their SHA-256 digest in a
+ * direct-mapped table whose size is fixed up front by the dedup
+ * parameter.  A later page with the same digest is written as a
+ * back-reference to the first one, so a match must be as good as a
+ * byte comparison: the earlier page may have changed since it was
+ * written, which rules out comparing against memory.  When a slot is
+ * taken the first page keeps it, so the table never grows and the
+ * oldest copy is always the one referenced.  Only the single-threaded
+ * sparse writer calls dedup_find(), so one transform is enough.
+ */
+
+#define DEDUP_KEY_SIZE 32
+
+struct dedup_entry {
+    u8 key[DEDUP_KEY_SIZE];
+    u64 addr;
+};
+
+static struct dedup_entry *table;
+static unsigned long mask;
+static struct crypto_shash *tfm;
+
+int dedup_start(int mb) {
+    unsigned long n;
+    int err;
+
+    n = ((unsigned long) min(mb, LIME_MAX_DEDUP) << 20) / sizeof(struct dedup_entry);
+    if (!n)
+        return -EINVAL;
+
+    tfm = crypto_alloc_shash("sha256", 0, 0);
+    if (IS_ERR(tfm)) {
+        err = PTR_ERR(tfm);
+        DBG("dedup needs sha256: %d", err);
+        tfm = NULL;
+        return err;
+    }
+
+    n = rounddown_pow_of_two(n);
+    table = vzalloc(n * sizeof(struct dedup_entry));
+    if (!table) {
+        DBG("Failed to allocate %lu dedup entries", n);
+        dedup_stop();
+        return -ENOMEM;
+    }
+    mask = n - 1;
+
+    DBG("Deduplicating with %lu entries", n);
+
+    return 0;
+}
+
+/*
+ * Look up the page at addr, already read to v.  Returns 1 and the
+ * address of an earlier identical page in src, or records the page and
+ * returns 0.
+ */
+int dedup_find(const void *v, resource_size_t addr, resource_size_t *src) {
+    SHASH_DESC_ON_STACK(desc, tfm);
+    struct dedup_entry *e;
+    u8 key[DEDUP_KEY_SIZE];
+    u64 slot;
+
+    desc->tfm = tfm;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,2,0)
+    desc->flags = 0;
+#endif
+
+    // Without a digest the page cannot be matched, only written
+    if (crypto_shash_digest(desc, v, PAGE_SIZE, key))
+        return 0;
+
+    memcpy(&slot, key, sizeof(slot));
+    e = &table[slot & mask];
+
+    if (!memcmp(e->key, key, DEDUP_KEY_SIZE)) {
+        *src = e->addr;
+        return 1;
+    }
+
+    // A slot is free while its key is zero
+    if (!memchr_inv(e->key, 0, DEDUP_KEY_SIZE)) {
+        memcpy(e->key, key, DEDUP_KEY_SIZE);
+        e->addr = addr;
+    }
+
+    return 0;
+}
+
+void dedup_stop(void) {
+    vfree(table);
+    table = NULL;
+
+    if (tfm) {
+        crypto_free_shash(tfm);
+        tfm = NULL;
+    }
+}
+
+#endif
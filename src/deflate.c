@@ -28,6 +28,10 @@
 
 #include "lime.h"
 
+#ifdef LIME_SUPPORTS_GZIP
+#include <linux/crc32.h>
+#endif
+
 /* Balance high compression level and memory footprint. */
 #define DEFLATE_WBITS       11  /* 8KB */
 #define DEFLATE_MEMLEVEL    5   /* 12KB */
@@ -98,4 +102,84 @@ ssize_t deflate(const void *in, size_t inlen)
     return avail_out - zstream.avail_out;
 }
 
+#ifdef LIME_SUPPORTS_GZIP
+/*
+ * Independent gzip members (RFC 1952) for chunked compression.
+ *
+ * Each member carries an "LM" extra field holding its own total size and
+ * the size of the input it decodes to, so a reader can walk the members
+ * without inflating them.  Tools that do not know the field skip it, and
+ * any multi-member aware inflater (gzip -d, zcat) decodes the whole file.
+ */
+#define GZIP_HEADER_SIZE    24
+#define GZIP_TRAILER_SIZE   8
+
+int deflate_member_workspacesize(void)
+{
+    return ALIGN(sizeof(struct z_stream_s), sizeof(long)) +
+           zlib_deflate_workspacesize(DEFLATE_WBITS, DEFLATE_MEMLEVEL);
+}
+
+size_t deflate_member_bound(size_t inlen)
+{
+    /* Stored-block worst case plus framing, as in zlib's deflateBound(). */
+    return inlen + (inlen >> 3) + (inlen >> 6) + 5 +
+           GZIP_HEADER_SIZE + GZIP_TRAILER_SIZE;
+}
+
+ssize_t deflate_member(void *ws, const void *in, size_t inlen, void *out, size_t outlen)
+{
+    struct z_stream_s *strm = ws;
+    u8 *o = out;
+    size_t size;
+    int ret;
+
+    if (outlen < GZIP_HEADER_SIZE + GZIP_TRAILER_SIZE)
+        return -EINVAL;
+
+    memset(strm, 0, sizeof(*strm));
+    strm->workspace = (u8 *) ws + ALIGN(sizeof(struct z_stream_s), sizeof(long));
+
+    /* Negative window bits: raw deflate, we write the gzip framing. */
+    if (zlib_deflateInit2(strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                          -DEFLATE_WBITS,
+                          DEFLATE_MEMLEVEL,
+                          Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -EINVAL;
+    }
+
+    strm->next_in = in;
+    strm->avail_in = inlen;
+    strm->next_out = o + GZIP_HEADER_SIZE;
+    strm->avail_out = outlen - GZIP_HEADER_SIZE - GZIP_TRAILER_SIZE;
+
+    ret = zlib_deflate(strm, Z_FINISH);
+    size = GZIP_HEADER_SIZE + strm->total_out + GZIP_TRAILER_SIZE;
+    zlib_deflateEnd(strm);
+
+    if (ret != Z_STREAM_END) {
+        DBG("Deflate member error: %d", ret);
+        return -EIO;
+    }
+
+    memset(o, 0, GZIP_HEADER_SIZE);
+    o[0] = 0x1f;                /* ID1 */
+    o[1] = 0x8b;                /* ID2 */
+    o[2] = Z_DEFLATED;          /* CM */
+    o[3] = 0x04;                /* FLG.FEXTRA */
+    o[9] = 0xff;                /* OS: unknown */
+    o[10] = 12;                 /* XLEN */
+    o[12] = 'L';                /* SI1 */
+    o[13] = 'M';                /* SI2 */
+    o[14] = 8;                  /* LEN */
+    lime_put_le32(o + 16, size);
+    lime_put_le32(o + 20, inlen);
+
+    lime_put_le32(o + size - 8, ~crc32_le(~0, in, inlen));
+    lime_put_le32(o + size - 4, inlen);
+
+    return size;
+}
+#endif
+
 #endif
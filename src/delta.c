@@ -0,0 +1,291 @@
+/*
+ * LiME - Linux Memory Extractor
+ * Copyright (c) 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ *
+ * Author:
+ * Joe T. Sylve, Ph.D.       - joe.sylve@gmail.com, @jtsylve
+ *
+ * SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "lime.h"
+
+#ifdef LIME_SUPPORTS_DELTA
+
+/*
+ * Page fingerprints for differential acquisition.
+ *
+ * Every page read is hashed with xxh64 into a table holding one entry
+ * per whole page of System RAM, in address order.  The table is written
+ * next to the image as <path>.fp: a lime_fp_header, the PFN ranges it
+ * covers and the hashes.  A zero entry marks a page that was not read.
+ *
+ * Given the table of an earlier run as baseline, the sparse lime writer
+ * leaves out every page whose hash is unchanged; tools/lime-apply.c
+ * patches the resulting records into the earlier image.  If the memory
+ * layout differs from the baseline every page counts as changed.
+ */
+
+struct delta_range {
+    unsigned long pfn;
+    unsigned long npages;
+    unsigned long base;
+};
+
+static struct delta_range *ranges;
+static unsigned int nranges;
+static unsigned long npages;
+
+static u64 *fps;
+static u64 *old;
+
+int delta_add_range(resource_size_t start, resource_size_t end) {
+    struct delta_range *r;
+
+    r = krealloc(ranges, (nranges + 1) * sizeof(*r), GFP_KERNEL);
+    if (!r)
+        return -ENOMEM;
+
+    ranges = r;
+    r += nranges++;
+
+    // A partial page at either end has no entry and is always sent
+    r->pfn = PFN_UP(start);
+    r->npages = (PFN_DOWN(end + 1) > r->pfn) ? PFN_DOWN(end + 1) - r->pfn : 0;
+    r->base = npages;
+    npages += r->npages;
+
+    return 0;
+}
+
+/* Table slot of a PFN; reader threads call this concurrently. */
+static long delta_index(unsigned long pfn) {
+    unsigned int lo = 0, hi = nranges, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if (pfn < ranges[mid].pfn)
+            hi = mid;
+        else if (pfn >= ranges[mid].pfn + ranges[mid].npages)
+            lo = mid + 1;
+        else
+            return ranges[mid].base + (pfn - ranges[mid].pfn);
+    }
+
+    return -1;
+}
+
+void delta_record(unsigned long pfn, const void *v) {
+    long i = delta_index(pfn);
+
+    if (i >= 0)
+        fps[i] = xxh64(v, PAGE_SIZE, 0);
+}
+
+/* Whether a page recorded this run differs from the baseline. */
+int delta_changed(unsigned long pfn) {
+    long i;
+
+    if (!old)
+        return 1;
+
+    i = delta_index(pfn);
+
+    return i < 0 || !old[i] || old[i] != fps[i];
+}
+
+static int read_full(struct file *f, void *buf, size_t len, loff_t *pos) {
+    size_t done = 0;
+    ssize_t r;
+
+    while (done < len) {
+        r = kernel_read(f, (u8 *) buf + done, len - done, pos);
+        if (r <= 0)
+            return (r < 0) ? r : -EIO;
+        done += r;
+    }
+
+    return 0;
+}
+
+static int delta_load(char *file) {
+    lime_fp_header header;
+    lime_fp_range r;
+    struct file *f;
+    loff_t pos = 0;
+    unsigned int i;
+    int err;
+
+    f = filp_open(file, O_RDONLY | O_LARGEFILE, 0);
+    if (!f || IS_ERR(f)) {
+        DBG("Error opening baseline %ld", PTR_ERR(f));
+        return (f) ? PTR_ERR(f) : -EIO;
+    }
+
+    if ((err = read_full(f, &header, sizeof(header), &pos)) < 0)
+        goto out;
+
+    if (header.magic != LIME_FP_MAGIC || header.version != 1 || header.page_size != PAGE_SIZE) {
+        DBG("%s is not a fingerprint table", file);
+        err = -EINVAL;
+        goto out;
+    }
+
+    if (header.nranges != nranges || header.npages != npages)
+        goto layout;
+
+    for (i = 0; i < nranges; i++) {
+        if ((err = read_full(f, &r, sizeof(r), &pos)) < 0)
+            goto out;
+        if (r.s_pfn != ranges[i].pfn || r.npages != ranges[i].npages)
+            goto layout;
+    }
+
+    old = vmalloc(npages * sizeof(u64));
+    if (!old) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    if ((err = read_full(f, old, npages * sizeof(u64), &pos)) < 0) {
+        vfree(old);
+        old = NULL;
+        goto out;
+    }
+
+    DBG("Loaded %lu fingerprints from %s", npages, file);
+    goto out;
+
+layout:
+    // Memory was hotplugged or the table is from another machine
+    DBG("Baseline memory layout differs, sending every page");
+    err = 0;
+
+out:
+    filp_close(f, NULL);
+    return err;
+}
+
+int delta_start(char *baseline) {
+    int err;
+
+    if (!npages)
+        return -EINVAL;
+
+    fps = vzalloc(npages * sizeof(u64));
+    if (!fps) {
+        DBG("Failed to allocate %lu fingerprints", npages);
+        delta_stop();
+        return -ENOMEM;
+    }
+
+    if (baseline && (err = delta_load(baseline)) < 0) {
+        delta_stop();
+        return err;
+    }
+
+    DBG("Fingerprinting %lu pages in %u ranges", npages, nranges);
+
+    return 0;
+}
+
+static ssize_t delta_write(ssize_t (*write)(void *, size_t)) {
+    lime_fp_header header;
+    lime_fp_range r;
+    size_t off, len;
+    unsigned int i;
+    ssize_t ret;
+
+    memset(&header, 0, sizeof(lime_fp_header));
+    header.magic = LIME_FP_MAGIC;
+    header.version = 1;
+    header.page_size = PAGE_SIZE;
+    header.nranges = nranges;
+    header.npages = npages;
+
+    if ((ret = RETRY_IF_INTERRUPTED(write(&header, sizeof(header)))) < 0)
+        return ret;
+
+    for (i = 0; i < nranges; i++) {
+        r.s_pfn = ranges[i].pfn;
+        r.npages = ranges[i].npages;
+        if ((ret = RETRY_IF_INTERRUPTED(write(&r, sizeof(r)))) < 0)
+            return ret;
+    }
+
+    // In chunks, as a single write of a large table would come up short
+    for (off = 0; off < npages * sizeof(u64); off += len) {
+        len = min_t(size_t, npages * sizeof(u64) - off, LIME_CHUNK_SIZE);
+        if ((ret = RETRY_IF_INTERRUPTED(write((u8 *) fps + off, len))) < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+int delta_write_tcp(void) {
+    int ret;
+
+    ret = setup_tcp(1);
+    if (ret < 0) {
+        DBG("Socket bind failed for fingerprint table: %d", ret);
+        cleanup_tcp();
+        return ret;
+    }
+
+    ret = (delta_write(write_vaddr_tcp) < 0) ? -EIO : 0;
+
+    cleanup_tcp();
+
+    return ret;
+}
+
+int delta_write_disk(void) {
+    char *p;
+    int ret;
+    int len;
+
+    len = strlen(path) + sizeof(".fp");
+    p = kmalloc(len, GFP_KERNEL);
+    if (!p)
+        return -ENOMEM;
+
+    snprintf(p, len, "%s.fp", path);
+
+    if ((ret = setup_disk(p, 0)) == 0)
+        ret = (delta_write(write_vaddr_disk) < 0) ? -EIO : 0;
+
+    cleanup_disk();
+    kfree(p);
+
+    return ret;
+}
+
+void delta_stop(void) {
+    vfree(fps);
+    fps = NULL;
+    vfree(old);
+    old = NULL;
+    kfree(ranges);
+    ranges = NULL;
+    nranges = 0;
+    npages = 0;
+}
+
+#endif
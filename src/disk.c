@@ -27,6 +27,253 @@
 
 static struct file * f = NULL;
 
+/* Bytes skipped by skip_disk() and not yet followed by a write. */
+static loff_t hole = 0;
+
+#ifdef LIME_SUPPORTS_PREALLOC
+/* Bytes reserved by prealloc_disk(), released past the end of a short dump. */
+static loff_t reserved = 0;
+#endif
+
+#ifdef LIME_SUPPORTS_AIO_DIO
+/*
+ * Asynchronous direct I/O.
+ *
+ * Output is gathered into dio_depth buffers of LIME_CHUNK_SIZE.  A full
+ * buffer is submitted as one O_DIRECT kiocb and the next free buffer
+ * takes over; a buffer is only reused once its write has completed, so
+ * up to dio_depth writes are in flight.  Only whole buffers go out this
+ * way, which keeps every write aligned; the tail is written buffered
+ * when the dump is flushed.
+ */
+struct lime_dio {
+    struct kiocb iocb;
+    struct bio_vec *bvec;
+    void *buf;
+    size_t len;
+    struct completion done;
+    long res;
+    int busy;
+};
+
+static struct lime_dio *dios;
+static int ndios;
+static int cur;
+static loff_t dio_pos;
+static int dio_err;
+
+/*
+ * Hold off filesystem freezes while a write is in flight, as the aio and
+ * io_uring write paths do.  Since 6.7 vfs_iocb_iter_write() takes the
+ * lock itself and drops it unless the write is queued; before, the
+ * caller does both.  A queued write completes in another context, so
+ * the lock is handed over to the completion for lockdep.
+ */
+static void dio_start_write(struct kiocb *iocb) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,7,0)
+    struct inode *inode = file_inode(iocb->ki_filp);
+
+    if (!S_ISREG(inode->i_mode))
+        return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,6,0)
+    kiocb_start_write(iocb);
+#else
+    sb_start_write(inode->i_sb);
+    __sb_writers_release(inode->i_sb, SB_FREEZE_WRITE);
+#endif
+#endif
+}
+
+static void dio_end_write(struct kiocb *iocb) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+    kiocb_end_write(iocb);
+#else
+    struct inode *inode = file_inode(iocb->ki_filp);
+
+    if (!S_ISREG(inode->i_mode))
+        return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,6,0)
+    kiocb_end_write(iocb);
+#else
+    __sb_writers_acquired(inode->i_sb, SB_FREEZE_WRITE);
+    sb_end_write(inode->i_sb);
+#endif
+#endif
+}
+
+static void dio_done(struct lime_dio *d, long res) {
+    d->res = res;
+    complete(&d->done);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+static void dio_complete(struct kiocb *iocb, long res)
+#else
+static void dio_complete(struct kiocb *iocb, long res, long res2)
+#endif
+{
+    dio_end_write(iocb);
+    dio_done(container_of(iocb, struct lime_dio, iocb), res);
+}
+
+/* Wait for a buffer's write to finish and note any failure. */
+static void dio_wait(struct lime_dio *d) {
+    if (!d->busy)
+        return;
+
+    wait_for_completion(&d->done);
+    d->busy = 0;
+
+    if (d->res != (long) d->len) {
+        DBG("Direct IO write error: %ld of %zu bytes", d->res, d->len);
+        dio_err = (d->res < 0) ? d->res : -EIO;
+    }
+    d->len = 0;
+}
+
+static void dio_submit(struct lime_dio *d) {
+    struct iov_iter iter;
+    ssize_t ret;
+
+    init_sync_kiocb(&d->iocb, f);
+    d->iocb.ki_pos = dio_pos;
+    d->iocb.ki_flags |= IOCB_DIRECT;
+    d->iocb.ki_complete = dio_complete;
+
+    iov_iter_bvec(&iter, WRITE, d->bvec, DIV_ROUND_UP(d->len, PAGE_SIZE), d->len);
+
+    reinit_completion(&d->done);
+    d->busy = 1;
+    dio_pos += d->len;
+
+    // The bvecs hold the pages, not the vmalloc alias they were filled through
+    flush_kernel_vmap_range(d->buf, d->len);
+
+    dio_start_write(&d->iocb);
+
+    ret = vfs_iocb_iter_write(f, &d->iocb, &iter);
+    if (ret != -EIOCBQUEUED) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,7,0)
+        dio_end_write(&d->iocb);
+#endif
+        dio_done(d, ret);
+    }
+}
+
+static void dio_free(void) {
+    int i;
+
+    if (!dios)
+        return;
+
+    for (i = 0; i < ndios; i++) {
+        dio_wait(&dios[i]);
+        vfree(dios[i].buf);
+        kfree(dios[i].bvec);
+    }
+    kfree(dios);
+    dios = NULL;
+}
+
+static int dio_alloc(int depth) {
+    unsigned int i, j, npages = LIME_CHUNK_SIZE / PAGE_SIZE;
+
+    ndios = min(depth, LIME_MAX_DIO_DEPTH);
+    dios = kcalloc(ndios, sizeof(*dios), GFP_KERNEL);
+    if (!dios)
+        return -ENOMEM;
+
+    for (i = 0; i < ndios; i++) {
+        dios[i].buf = vmalloc(LIME_CHUNK_SIZE);
+        dios[i].bvec = kcalloc(npages, sizeof(struct bio_vec), GFP_KERNEL);
+        if (!dios[i].buf || !dios[i].bvec) {
+            dio_free();
+            return -ENOMEM;
+        }
+
+        for (j = 0; j < npages; j++) {
+            dios[i].bvec[j].bv_page = vmalloc_to_page((u8 *) dios[i].buf + j * PAGE_SIZE);
+            dios[i].bvec[j].bv_len = PAGE_SIZE;
+            dios[i].bvec[j].bv_offset = 0;
+        }
+        init_completion(&dios[i].done);
+    }
+
+    cur = 0;
+    dio_pos = 0;
+    dio_err = 0;
+
+    DBG("Asynchronous Direct IO with %d buffers", ndios);
+
+    return 0;
+}
+
+static ssize_t dio_write(void *v, size_t is) {
+    struct lime_dio *d;
+    size_t n, done = 0;
+
+    while (done < is) {
+        d = &dios[cur];
+        dio_wait(d);
+        if (dio_err)
+            return dio_err;
+
+        n = min(is - done, LIME_CHUNK_SIZE - d->len);
+        if (v)
+            memcpy((u8 *) d->buf + d->len, (u8 *) v + done, n);
+        else
+            memset((u8 *) d->buf + d->len, 0, n);
+        d->len += n;
+        done += n;
+
+        if (d->len == LIME_CHUNK_SIZE) {
+            dio_submit(d);
+            cur = (cur + 1) % ndios;
+        }
+    }
+
+    return is;
+}
+
+/*
+ * Complete all outstanding asynchronous writes, write the unaligned tail
+ * through the page cache and sync the file.
+ */
+static ssize_t dio_flush(void) {
+    struct lime_dio *d;
+    ssize_t ret;
+    loff_t pos;
+    int i;
+
+    if (!dios)
+        return 0;
+
+    d = &dios[cur];
+    for (i = 0; i < ndios; i++)
+        dio_wait(&dios[i]);
+
+    if (dio_err)
+        return dio_err;
+
+    /* Clear O_DIRECT the way fcntl(F_SETFL) does for the buffered tail. */
+    spin_lock(&f->f_lock);
+    f->f_flags &= ~O_DIRECT;
+    spin_unlock(&f->f_lock);
+
+    pos = dio_pos;
+    ret = d->len ? kernel_write(f, d->buf, d->len, &pos) : 0;
+    d->len = 0;
+    f->f_pos = pos;
+
+    if (ret >= 0)
+        ret = vfs_fsync(f, 0);
+
+    return ret;
+}
+#endif
+
 static int dio_write_test(char *path, int oflags)
 {
     int ok;
@@ -54,6 +301,23 @@ int setup_disk(char *path, int dio) {
     set_fs(KERNEL_DS);
 #endif
 
+    hole = 0;
+
+#ifdef LIME_SUPPORTS_AIO_DIO
+    /* Whole-buffer writes need no O_SYNC; flush_disk() syncs at the end. */
+    if (dio && dio_depth > 0 && !dio_alloc(dio_depth)) {
+        f = filp_open(path, oflags | O_DIRECT, 0444);
+        if (f && !IS_ERR(f) && f->f_op->write_iter)
+            goto out;
+
+        DBG("Asynchronous Direct IO unavailable");
+        if (f && !IS_ERR(f))
+            filp_close(f, NULL);
+        f = NULL;
+        dio_free();
+    }
+#endif
+
     if (dio && dio_write_test(path, oflags)) {
         oflags |= O_DIRECT | O_SYNC;
     } else {
@@ -69,6 +333,9 @@ int setup_disk(char *path, int dio) {
         f = NULL;
     }
 
+#ifdef LIME_SUPPORTS_AIO_DIO
+out:
+#endif
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0)
     set_fs(fs);
 #endif
@@ -76,7 +343,9 @@ int setup_disk(char *path, int dio) {
     return err;
 }
 
-void cleanup_disk(void) {
+/* Finish and close the file; returns an error if buffered output could not be written. */
+int cleanup_disk(void) {
+    int err = 0;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0)
     mm_segment_t fs;
 
@@ -84,6 +353,37 @@ void cleanup_disk(void) {
     set_fs(KERNEL_DS);
 #endif
 
+#ifdef LIME_SUPPORTS_AIO_DIO
+    if (f && (err = dio_flush()) < 0)
+        DBG("Error flushing Direct IO writes");
+    dio_free();
+#endif
+
+    // A trailing hole must be written out or the file comes up short
+    if (f && hole) {
+        size_t n = min_t(loff_t, hole, PAGE_SIZE);
+
+        hole -= n;
+        if (write_vaddr_disk(page_address(ZERO_PAGE(0)), n) != n && !err)
+            err = -EIO;
+        hole = 0;
+    }
+
+#ifdef LIME_SUPPORTS_PREALLOC
+    /*
+     * A dump that ended early or was cancelled leaves blocks past its
+     * end.  Truncating to the current size frees them; a hole punched
+     * past i_size is a no-op on ext4.
+     */
+    if (f && reserved) {
+        loff_t size = i_size_read(file_inode(f));
+
+        if (size < reserved && vfs_truncate(&f->f_path, size))
+            DBG("Could not release %lld reserved bytes", (long long) (reserved - size));
+        reserved = 0;
+    }
+#endif
+
     if(f) {
         filp_close(f, NULL);
         f = NULL;
@@ -92,6 +392,8 @@ void cleanup_disk(void) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0)
     set_fs(fs);
 #endif
+
+    return err;
 }
 
 ssize_t write_vaddr_disk(void * v, size_t is) {
@@ -101,7 +403,12 @@ ssize_t write_vaddr_disk(void * v, size_t is) {
     mm_segment_t fs;
 #endif
 
-    pos = f->f_pos;
+#ifdef LIME_SUPPORTS_AIO_DIO
+    if (dios)
+        return dio_write(v, is);
+#endif
+
+    pos = f->f_pos + hole;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0)
     fs = get_fs();
@@ -114,7 +421,77 @@ ssize_t write_vaddr_disk(void * v, size_t is) {
 
     if (s == is) {
         f->f_pos = pos;
+        hole = 0;
     }
 
     return s;
 }
+
+/*
+ * Advance the file position without writing.  The file is created empty,
+ * so the skipped bytes read back as zeros and take no space on
+ * filesystems that support sparse files.
+ */
+void skip_disk(size_t is) {
+#ifdef LIME_SUPPORTS_AIO_DIO
+    // Buffers are written whole, so a hole is written out as zeros
+    if (dios) {
+        dio_write(NULL, is);
+        return;
+    }
+#endif
+    hole += is;
+}
+
+
+/* Overwrite bytes written earlier, for regions read again after the dump. */
+ssize_t write_at_disk(void * v, size_t is, loff_t pos) {
+    ssize_t s;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0)
+    mm_segment_t fs;
+
+    fs = get_fs();
+    set_fs(KERNEL_DS);
+    s = vfs_write(f, v, is, &pos);
+    set_fs(fs);
+#else
+    s = kernel_write(f, v, is, &pos);
+#endif
+
+    return s;
+}
+
+#ifdef LIME_SUPPORTS_PREALLOC
+/*
+ * Fail if len bytes cannot fit on the output filesystem, and reserve
+ * them when the size is exact.  The reservation keeps the file size, so
+ * a dump that ends early leaves no trailing zeros, and cleanup_disk()
+ * gives back the blocks it did not use.
+ */
+int prealloc_disk(u64 len, int reserve) {
+    struct kstatfs st;
+    int err;
+
+    // ramfs and similar report no blocks at all
+    if (!vfs_statfs(&f->f_path, &st) && st.f_blocks && (u64) st.f_bavail * st.f_bsize < len) {
+        DBG("Output needs %llu bytes, %llu available", (unsigned long long) len,
+            (unsigned long long) st.f_bavail * st.f_bsize);
+        return -ENOSPC;
+    }
+
+    if (!reserve)
+        return 0;
+
+    err = vfs_fallocate(f, FALLOC_FL_KEEP_SIZE, 0, len);
+    if (err == -ENOSPC) {
+        DBG("Output needs %llu bytes, filesystem is full", (unsigned long long) len);
+        return err;
+    }
+    if (err)
+        DBG("Preallocation unavailable: %d", err);
+    else
+        reserved = len;
+
+    return 0;
+}
+#endif
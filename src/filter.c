@@ -0,0 +1,125 @@
+/*
+ * LiME - Linux Memory Extractor
+ * Copyright (c) 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ *
+ * Author:
+ * Joe T. Sylve, Ph.D.       - joe.sylve@gmail.com, @jtsylve
+ *
+ * SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "lime.h"
+
+#ifdef LIME_SUPPORTS_FILTER
+
+/*
+ * Page-class filtering for exclude=, with the bits of makedumpfile's
+ * dump level.
+ *
+ * Each page is classified from its struct page before it is read: the
+ * head of a free buddy block excludes the whole block, hugetlb pages
+ * are free while unreferenced and user data otherwise, and pages on the
+ * LRU are anonymous (or in swap cache) or file cache.  Dirty cache and
+ * cache under writeback is kept, as it is not on disk yet.  Pages that
+ * fit no class, such as slab and page tables, are kernel memory and are
+ * always kept.  Nothing is locked, so a page that changes state while
+ * the dump passes is classified as it was when looked at.
+ *
+ * Zero pages are found after reading, in main.c.
+ */
+
+// MAX_ORDER became MAX_PAGE_ORDER in 6.8; either bounds a sane order
+#ifdef MAX_PAGE_ORDER
+#define LIME_MAX_ORDER MAX_PAGE_ORDER
+#else
+#define LIME_MAX_ORDER MAX_ORDER
+#endif
+
+static int mask;
+
+void filter_start(int exclude) {
+    mask = exclude & (LIME_EXCLUDE_CACHE | LIME_EXCLUDE_CACHE_PRIVATE | LIME_EXCLUDE_USER | LIME_EXCLUDE_FREE);
+
+    if (exclude)
+        DBG("Excluding page classes 0x%x", exclude);
+}
+
+static int page_class(struct page *p) {
+    int lru, anon, swap, dirty, priv;
+    void *mapping;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+    struct folio *f = page_folio(p);
+
+    lru = folio_test_lru(f);
+    anon = folio_test_anon(f);
+    swap = folio_test_swapcache(f);
+    dirty = folio_test_dirty(f) || folio_test_writeback(f);
+    priv = folio_test_private(f);
+    mapping = READ_ONCE(f->mapping);
+#else
+    struct page *h = compound_head(p);
+
+    lru = PageLRU(h);
+    anon = PageAnon(h);
+    swap = PageSwapCache(h);
+    dirty = PageDirty(h) || PageWriteback(h);
+    priv = PagePrivate(h);
+    mapping = READ_ONCE(h->mapping);
+#endif
+
+    if (PageHuge(p))
+        return page_count(p) ? LIME_EXCLUDE_USER : LIME_EXCLUDE_FREE;
+
+    // Only LRU pages are known to use mapping for a file or anon_vma
+    if (!lru)
+        return 0;
+
+    if (anon || swap)
+        return LIME_EXCLUDE_USER;
+
+    if (!mapping || dirty)
+        return 0;
+
+    return priv ? LIME_EXCLUDE_CACHE_PRIVATE : LIME_EXCLUDE_CACHE;
+}
+
+/*
+ * Number of pages from pfn on that exclude= leaves out, 0 to read pfn.
+ * The caller has checked pfn_valid() and clamps the count to its range.
+ */
+unsigned long filter_page(unsigned long pfn) {
+    struct page *p;
+    unsigned long order;
+
+    if (!mask)
+        return 0;
+
+    p = pfn_to_page(pfn);
+
+    if (PageBuddy(p)) {
+        if (!(mask & LIME_EXCLUDE_FREE))
+            return 0;
+        // The order may be stale if the block was just allocated
+        order = page_private(p);
+        return (order <= LIME_MAX_ORDER && !(pfn & ((1UL << order) - 1))) ? 1UL << order : 1;
+    }
+
+    return (page_class(p) & mask) ? 1 : 0;
+}
+
+#endif
@@ -43,6 +43,15 @@ static struct crypto_tfm *tfm;
 int ldigest_init(void) {
     DBG("Initializing Digest Transformation.");
 
+#ifdef LIME_SUPPORTS_MERKLE
+    if (merkle > 0) {
+        digestsize = merkle_init(merkle);
+        if (digestsize <= 0)
+            goto init_fail;
+        goto alloc_output;
+    }
+#endif
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
     tfm = crypto_alloc_ahash(digest, 0, CRYPTO_ALG_ASYNC);
     if (unlikely(IS_ERR(tfm))) {
@@ -81,6 +90,9 @@ int ldigest_init(void) {
     goto init_fail;
 #endif
 
+#ifdef LIME_SUPPORTS_MERKLE
+alloc_output:
+#endif
     output = kzalloc(digestsize, GFP_ATOMIC);
     if (!output)
         goto init_fail;
@@ -111,6 +123,11 @@ int ldigest_update(void *v, size_t is) {
     int ret;
     struct scatterlist sg;
 
+#ifdef LIME_SUPPORTS_MERKLE
+    if (merkle > 0)
+        return merkle_update(v, is);
+#endif
+
     if (likely(virt_addr_valid(v))) {
         sg_init_one(&sg, (u8 *) v, is);
         ret = ldigest_update_sg(&sg, is);
@@ -144,6 +161,153 @@ update_fail:
     return LIME_DIGEST_FAILED;
 }
 
+#ifdef LIME_SUPPORTS_THREADS
+/*
+ * Asynchronous digest.
+ *
+ * ldigest_async_update() queues a reference to the caller's data and
+ * returns; a kthread hashes it from there, so hashing overlaps with
+ * reading memory and with the sink.  Nothing is copied: the caller keeps
+ * the data unchanged until ldigest_async_wait() has seen the worker get
+ * past it.  vmalloc'd data is hashed a span at a time with a scatterlist
+ * covering its pages in a single update.
+ */
+#define DIGEST_QUEUE_LEN    64
+#define DIGEST_SPAN_PAGES   (LIME_CHUNK_SIZE / PAGE_SIZE + 1)
+
+struct digest_ref {
+    u8 *v;
+    size_t len;
+};
+
+static struct digest_ref queue[DIGEST_QUEUE_LEN];
+static struct scatterlist *ring_sg;
+static struct task_struct *digest_task;
+static DECLARE_WAIT_QUEUE_HEAD(data_wait);
+static DECLARE_WAIT_QUEUE_HEAD(space_wait);
+
+/* References queued and references hashed; slots modulo the queue length. */
+static unsigned long queue_head;
+static unsigned long queue_tail;
+
+static int async_status;
+
+static int ldigest_update_span(u8 *p, size_t is) {
+    unsigned int i, n = DIV_ROUND_UP(offset_in_page(p) + is, PAGE_SIZE);
+    size_t off, len, left = is;
+
+    if (!is_vmalloc_addr(p))
+        return ldigest_update(p, is);
+
+    sg_init_table(ring_sg, n);
+    for (i = 0; i < n; i++) {
+        off = offset_in_page(p);
+        len = min(left, (size_t) PAGE_SIZE - off);
+        sg_set_page(&ring_sg[i], vmalloc_to_page(p), len, off);
+        p += len;
+        left -= len;
+    }
+
+    if (ldigest_update_sg(ring_sg, is) < 0) {
+        DBG("Digest Update Failed.");
+        return LIME_DIGEST_FAILED;
+    }
+
+    return LIME_DIGEST_COMPUTE;
+}
+
+static int digest_thread(void *arg) {
+    struct digest_ref *r;
+    size_t off, n;
+
+    for (;;) {
+        wait_event_interruptible(data_wait,
+            kthread_should_stop() || smp_load_acquire(&queue_head) != queue_tail);
+
+        if (smp_load_acquire(&queue_head) == queue_tail) {
+            if (kthread_should_stop())
+                break;
+            continue;
+        }
+
+        r = &queue[queue_tail % DIGEST_QUEUE_LEN];
+        for (off = 0; off < r->len && async_status == LIME_DIGEST_COMPUTE; off += n) {
+            n = min(r->len - off, (size_t) LIME_CHUNK_SIZE);
+            async_status = ldigest_update_span(r->v + off, n);
+        }
+
+        smp_store_release(&queue_tail, queue_tail + 1);
+        wake_up(&space_wait);
+    }
+
+    return 0;
+}
+
+int ldigest_async_start(void) {
+    ring_sg = kmalloc_array(DIGEST_SPAN_PAGES, sizeof(*ring_sg), GFP_KERNEL);
+    if (!ring_sg)
+        goto fail;
+
+    queue_head = queue_tail = 0;
+    async_status = LIME_DIGEST_COMPUTE;
+
+    digest_task = kthread_run(digest_thread, NULL, "lime/digest");
+    if (IS_ERR(digest_task)) {
+        digest_task = NULL;
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    DBG("Failed to start digest thread");
+    ldigest_async_stop();
+    return -ENOMEM;
+}
+
+int ldigest_async_update(void *v, size_t is) {
+    struct digest_ref *r;
+
+    if (is == 0 || async_status != LIME_DIGEST_COMPUTE)
+        return async_status;
+
+    wait_event(space_wait, queue_head - smp_load_acquire(&queue_tail) < DIGEST_QUEUE_LEN);
+
+    r = &queue[queue_head % DIGEST_QUEUE_LEN];
+    r->v = v;
+    r->len = is;
+    smp_store_release(&queue_head, queue_head + 1);
+    wake_up(&data_wait);
+
+    return async_status;
+}
+
+/* Where the queue ends now, for ldigest_async_wait(). */
+unsigned long ldigest_async_mark(void) {
+    return queue_head;
+}
+
+/* Wait until the worker is done with everything queued before mark. */
+void ldigest_async_wait(unsigned long mark) {
+    if (digest_task)
+        wait_event(space_wait, (long) (smp_load_acquire(&queue_tail) - mark) >= 0);
+}
+
+/* Wait for the worker to hash everything queued, then stop it. */
+int ldigest_async_stop(void) {
+    if (digest_task) {
+        ldigest_async_wait(queue_head);
+        kthread_stop(digest_task);
+        digest_task = NULL;
+    }
+
+    kfree(ring_sg);
+    ring_sg = NULL;
+
+    return async_status;
+}
+#endif
+
 int ldigest_final(void) {
     int ret, i;
 
@@ -152,6 +316,14 @@ int ldigest_final(void) {
     if (!digest_value)
         goto final_fail;
 
+#ifdef LIME_SUPPORTS_MERKLE
+    if (merkle > 0) {
+        if (merkle_final(output) < 0)
+            goto final_fail;
+        goto format;
+    }
+#endif
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
     ret = crypto_ahash_final(req);
     if (ret < 0)
@@ -164,6 +336,9 @@ int ldigest_final(void) {
     crypto_digest_final(tfm, output);
 #endif
 
+#ifdef LIME_SUPPORTS_MERKLE
+format:
+#endif
     for (i = 0; i<digestsize; i++) {
         sprintf(digest_value + i*2, "%02x", output[i]);
     }
@@ -179,7 +354,7 @@ final_fail:
 int ldigest_write_tcp(void) {
     int ret;
 
-    ret = setup_tcp();
+    ret = setup_tcp(1);
     if (ret < 0) {
         DBG("Socket bind failed for digest file: %d", ret);
         cleanup_tcp();
@@ -190,6 +365,12 @@ int ldigest_write_tcp(void) {
 
     cleanup_tcp();
 
+#ifdef LIME_SUPPORTS_MERKLE
+    // The manifest follows on a connection of its own
+    if (merkle > 0)
+        return merkle_write_tcp();
+#endif
+
     return 0;
 }
 
@@ -216,10 +397,21 @@ out:
     cleanup_disk();
     kfree(p);
 
+#ifdef LIME_SUPPORTS_MERKLE
+    if (merkle > 0 && ret == 0)
+        ret = merkle_write_disk();
+#endif
+
     return ret;
 }
 
 void ldigest_clean(void) {
+#ifdef LIME_SUPPORTS_THREADS
+    ldigest_async_stop();
+#endif
+#ifdef LIME_SUPPORTS_MERKLE
+    merkle_clean();
+#endif
     kfree(digest_value);
     kfree(output);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
@@ -37,6 +37,19 @@
 #include <linux/err.h>
 #include <linux/scatterlist.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/percpu.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/sort.h>
+#include <linux/nodemask.h>
+#include <linux/cache.h>
 
 #include <net/sock.h>
 #include <net/tcp.h>
@@ -50,14 +63,45 @@
 #define LIME_RAMSTR "System RAM"
 #define LIME_MAX_FILENAME_SIZE 256
 #define LIME_MAGIC 0x4C694D45 //LiME
+#define LIME_FILL_MAGIC 0x4C694D46 //LiMF
+#define LIME_STREAM_MAGIC 0x4C694D53 //LiMS
+#define LIME_INDEX_MAGIC 0x4C694D49 //LiMI
+#define LIME_FP_MAGIC 0x4C694D48 //LiMH
+#define LIME_DEDUP_MAGIC 0x4C694D44 //LiMD
 
 #define LIME_MODE_RAW 0
 #define LIME_MODE_LIME 1
 #define LIME_MODE_PADDED 2
+#define LIME_MODE_LIME2 3
+
+#define LIME_COMPRESS_NONE 0
+#define LIME_COMPRESS_DEFLATE 1
+#define LIME_COMPRESS_LZ4 2
+#define LIME_COMPRESS_ZSTD 3
+#define LIME_COMPRESS_LZ4HC 4
+
+// lime2 index entry flags: how a block is stored
+#define LIME_BLOCK_GZIP 1
+#define LIME_BLOCK_LZ4 2
+#define LIME_BLOCK_ZSTD 3
 
 #define LIME_METHOD_UNKNOWN 0
 #define LIME_METHOD_TCP 1
 #define LIME_METHOD_DISK 2
+#define LIME_METHOD_BLK 3
+#define LIME_METHOD_VSOCK 4
+
+// Methods served by tcp.c
+#define LIME_METHOD_IS_SOCKET(m) ((m) == LIME_METHOD_TCP || (m) == LIME_METHOD_VSOCK)
+
+// Acquisition states reported by /sys/module/lime/control
+#define LIME_STATE_IDLE 0
+#define LIME_STATE_RUNNING 1
+#define LIME_STATE_PAUSED 2
+#define LIME_STATE_CANCELLING 3
+#define LIME_STATE_DONE 4
+#define LIME_STATE_CANCELLED 5
+#define LIME_STATE_FAILED 6
 
 #define LIME_DIGEST_FAILED -1
 #define LIME_DIGEST_COMPLETE 0
@@ -90,25 +134,288 @@
 #define lime_unmap_page(v, page) kunmap(page)
 #endif
 
+// Without highmem all RAM is in the direct map, where runs of PFNs are contiguous
+#if defined(CONFIG_64BIT) && !defined(CONFIG_HIGHMEM)
+#define LIME_SUPPORTS_DIRECT_RUN
+#endif
+
+// Non-temporal prefetch hints for lowcache=1
+#if defined(CONFIG_X86_64) || defined(CONFIG_ARM64)
+#define LIME_SUPPORTS_LOWCACHE
+#endif
+
+// memcpy_flushcache() stores around the cache only where the arch provides it
+#if defined(LIME_SUPPORTS_LOWCACHE) && defined(CONFIG_ARCH_HAS_UACCESS_FLUSHCACHE)
+#define LIME_SUPPORTS_LOWCACHE_STORES
+#endif
+
 #ifdef CONFIG_ZLIB_DEFLATE
 #define LIME_SUPPORTS_DEFLATE
 #endif
 
+// gzip framing needs the kernel crc32 for the member trailer
+#if defined(LIME_SUPPORTS_DEFLATE) && (defined(CONFIG_CRC32) || defined(CONFIG_CRC32_MODULE))
+#define LIME_SUPPORTS_GZIP
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
+#define LIME_SUPPORTS_THREADS
+#endif
+
+// The LZ4_* library API replaced lz4_compress() in 4.11
+#if (defined(CONFIG_LZ4_COMPRESS) || defined(CONFIG_LZ4_COMPRESS_MODULE)) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#define LIME_SUPPORTS_LZ4
+#endif
+
+#if (defined(CONFIG_LZ4HC_COMPRESS) || defined(CONFIG_LZ4HC_COMPRESS_MODULE)) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#define LIME_SUPPORTS_LZ4HC
+#endif
+
+// The zstd_* wrapper API arrived with the zstd 1.4.10 update in 5.16
+#if (defined(CONFIG_ZSTD_COMPRESS) || defined(CONFIG_ZSTD_COMPRESS_MODULE)) && LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+#define LIME_SUPPORTS_ZSTD
+#endif
+
+#if defined(LIME_SUPPORTS_DEFLATE) || defined(LIME_SUPPORTS_LZ4) || defined(LIME_SUPPORTS_LZ4HC) || defined(LIME_SUPPORTS_ZSTD)
+#define LIME_SUPPORTS_COMPRESS
+#endif
+
+#if defined(LIME_SUPPORTS_THREADS) && (defined(LIME_SUPPORTS_GZIP) || defined(LIME_SUPPORTS_LZ4) || \
+                                       defined(LIME_SUPPORTS_LZ4HC) || defined(LIME_SUPPORTS_ZSTD))
+#define LIME_SUPPORTS_COMPRESS_THREADS
+#endif
+
+// Chunk hashes use the shash API from <crypto/hash.h>, included above since 4.6
+#if defined(LIME_SUPPORTS_THREADS) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
+#define LIME_SUPPORTS_MERKLE
+#endif
+
+// sendpage_ok() appeared in 5.9; 6.5 replaced sendpage with MSG_SPLICE_PAGES
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
+#define LIME_SUPPORTS_ZEROCOPY
+#endif
+
+// vfs_iocb_iter_write() appeared in 5.8
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+#define LIME_SUPPORTS_AIO_DIO
+#endif
+
+// AF_VSOCK kernel sockets; sock_create_kern() takes a namespace since 4.2
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+#define LIME_SUPPORTS_VSOCK
+#include <linux/vm_sockets.h>
+#endif
+
+// this_cpu_add() appeared in 2.6.33
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+#define LIME_SUPPORTS_STATS
+#endif
+
+#ifdef LIME_SUPPORTS_STATS
+#define LIME_SUPPORTS_CONTROL
+#endif
+
+// Page fingerprints use the kernel xxh64, added in 4.14
+#if (defined(CONFIG_XXHASH) || defined(CONFIG_XXHASH_MODULE)) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+#define LIME_SUPPORTS_DELTA
+#include <linux/xxhash.h>
+#endif
+
+// Dedup keys pages by SHA-256 through the shash API, as merkle.c does
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
+#define LIME_SUPPORTS_DEDUP
+#endif
+
+// Preallocating disk output uses vfs_fallocate(), exported since 3.19
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
+#define LIME_SUPPORTS_PREALLOC
+#include <linux/falloc.h>
+#include <linux/statfs.h>
+#endif
+
+// usleep_range() appeared in 2.6.36
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+#define LIME_SUPPORTS_THROTTLE
+#include <linux/delay.h>
+#endif
+
+// exclude= classifies pages by their flags; older kernels lack some of the helpers
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0)
+#define LIME_SUPPORTS_FILTER
+#endif
+
+// bio_alloc() takes the device since 5.18; bdev_nr_bytes() appeared in 5.16
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
+#define LIME_SUPPORTS_BLK
+#endif
+
+/* Pages handed to the socket per zero-copy send */
+#define LIME_ZEROCOPY_BATCH 16
+
+/* Unit of work handed to reader threads */
+#define LIME_CHUNK_SIZE (1UL << 20)
+
+/* Upper bound for the bufsize parameter, in MB */
+#define LIME_MAX_BUFSIZE 64
+
+/* Upper bound for the dio_depth parameter */
+#define LIME_MAX_DIO_DEPTH 32
+
+/* Upper bound for the streams parameter */
+#define LIME_MAX_STREAMS 16
+
+/* Upper bound for the dedup parameter, in MB */
+#define LIME_MAX_DEDUP 1024
+
+/* Bios in flight for blk: output when dio_depth is not set */
+#define LIME_BLK_DEPTH 4
+
+/* Pages read between checks of the latency budget */
+#define LIME_BUDGET_STRIDE 16
+
+/* Most chunks skipped at once after repeated slow chunks */
+#define LIME_MAX_BACKOFF 64
+
+/* Pages between samples when estimating sparse output with prescan=2 */
+#define LIME_PRESCAN_STRIDE 256
+
+/* Page classes for the exclude parameter, as in makedumpfile's dump level */
+#define LIME_EXCLUDE_ZERO 1
+#define LIME_EXCLUDE_CACHE 2
+#define LIME_EXCLUDE_CACHE_PRIVATE 4
+#define LIME_EXCLUDE_USER 8
+#define LIME_EXCLUDE_FREE 16
+
+/* Progress counters, one set per CPU; see stats.c */
+struct lime_stats {
+    u64 read;
+    u64 written;
+    u64 padded;
+    u64 excluded;
+    u64 invalid;
+    u64 copy_errors;
+};
+
+#ifdef LIME_SUPPORTS_STATS
+DECLARE_PER_CPU(struct lime_stats, lime_stats);
+#define lime_stat_add(field, n) this_cpu_add(lime_stats.field, (n))
+#else
+#define lime_stat_add(field, n) do {} while (0)
+#endif
+
+/* Latency budget of the chunk being read; see budget.c */
+struct lime_budget {
+    resource_size_t next;
+    resource_size_t skip_end;
+    u64 deadline;
+    u64 stalled;
+    unsigned long resumes;
+    unsigned int pages;
+    unsigned int slow;
+    int late;
+    int reader;
+};
+
+static inline void budget_start(struct lime_budget *b, resource_size_t start) {
+    memset(b, 0, sizeof(*b));
+    b->next = b->skip_end = start;
+}
+
+/* CPU time a thread has used since it last yielded for max_cpu */
+struct lime_duty {
+    u64 wall;
+    u64 cpu;
+};
+
+/* pfn_valid() that counts the PFNs it turns away. */
+static inline int lime_pfn_valid(unsigned long pfn) {
+    if (likely(pfn_valid(pfn)))
+        return 1;
+
+    lime_stat_add(invalid, 1);
+    return 0;
+}
+
+#ifdef LIME_SUPPORTS_LOWCACHE
+/*
+ * Pull a page toward the CPU with the non-temporal hint before it is
+ * copied, so the copy finds it there without displacing the rest of the
+ * cache hierarchy.  A prefetch is only a hint and does not consume a
+ * poisoned line; the copy that follows still catches machine checks.
+ */
+static inline void lime_prefetch_page(const void *v) {
+    const u8 *p = v;
+    size_t i;
+
+    for (i = 0; i < PAGE_SIZE; i += L1_CACHE_BYTES) {
+#ifdef CONFIG_X86_64
+        asm volatile("prefetchnta %0" : : "m" (p[i]));
+#else
+        asm volatile("prfm pldl1strm, [%0]" : : "r" (p + i));
+#endif
+    }
+}
+#endif
+
+static inline void lime_put_le32(u8 *p, u32 v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
 // main.c globals
 extern char *path;
 extern char *digest;
+extern int method;
 extern int port;
+extern unsigned int cid;
 extern int localhostonly;
+#ifdef LIME_SUPPORTS_TIMING
+extern long timeout;
+#endif
+extern void read_page(void *, unsigned long);
+#ifdef LIME_SUPPORTS_DIRECT_RUN
+extern unsigned long direct_run(resource_size_t, resource_size_t);
+extern void read_run(void *, unsigned long, unsigned long);
+#else
+static inline unsigned long direct_run(resource_size_t addr, resource_size_t end) { return 0; }
+static inline void read_run(void *dst, unsigned long pfn, unsigned long n) { }
+#endif
+#ifdef LIME_SUPPORTS_MERKLE
+extern int merkle;
+#endif
+#ifdef LIME_SUPPORTS_AIO_DIO
+extern int dio_depth;
+#endif
 
 // tcp.c
 extern ssize_t write_vaddr_tcp(void *, size_t);
-extern int setup_tcp(void);
-extern void cleanup_tcp(void);
+extern int setup_tcp(int);
+extern int cleanup_tcp(void);
+extern void abort_tcp(void);
+#ifdef LIME_SUPPORTS_ZEROCOPY
+extern ssize_t write_pages_tcp(struct page **, unsigned int);
+#endif
 
 // disk.c
 extern ssize_t write_vaddr_disk(void *, size_t);
 extern int setup_disk(char *, int);
-extern void cleanup_disk(void);
+extern int cleanup_disk(void);
+extern void skip_disk(size_t);
+extern ssize_t write_at_disk(void *, size_t, loff_t);
+#ifdef LIME_SUPPORTS_PREALLOC
+extern int prealloc_disk(u64, int);
+#endif
+
+// blk.c
+#ifdef LIME_SUPPORTS_BLK
+extern ssize_t write_vaddr_blk(void *, size_t);
+extern ssize_t write_stage_blk(void *, size_t);
+extern int release_stage_blk(void *);
+extern int setup_blk(char *);
+extern int cleanup_blk(void);
+#endif
 
 // hash.c
 extern int ldigest_init(void);
@@ -117,6 +424,13 @@ extern int ldigest_final(void);
 extern int ldigest_write_tcp(void);
 extern int ldigest_write_disk(void);
 extern void ldigest_clean(void);
+#ifdef LIME_SUPPORTS_THREADS
+extern int ldigest_async_start(void);
+extern int ldigest_async_update(void *, size_t);
+extern unsigned long ldigest_async_mark(void);
+extern void ldigest_async_wait(unsigned long);
+extern int ldigest_async_stop(void);
+#endif
 
 // deflate.c
 #ifdef LIME_SUPPORTS_DEFLATE
@@ -124,6 +438,155 @@ extern int deflate_begin_stream(void *, size_t);
 extern int deflate_end_stream(void);
 extern ssize_t deflate(const void *, size_t);
 #endif
+#ifdef LIME_SUPPORTS_GZIP
+extern int deflate_member_workspacesize(void);
+extern size_t deflate_member_bound(size_t);
+extern ssize_t deflate_member(void *, const void *, size_t, void *, size_t);
+#endif
+
+// lz4.c
+#ifdef LIME_SUPPORTS_LZ4
+extern int lz4_member_workspacesize(void);
+extern ssize_t lz4_member(void *, const void *, size_t, void *, size_t);
+#endif
+#ifdef LIME_SUPPORTS_LZ4HC
+extern int lz4hc_member_workspacesize(void);
+extern ssize_t lz4hc_member(void *, const void *, size_t, void *, size_t);
+#endif
+#if defined(LIME_SUPPORTS_LZ4) || defined(LIME_SUPPORTS_LZ4HC)
+extern size_t lz4_member_bound(size_t);
+#endif
+
+// zstd.c
+#ifdef LIME_SUPPORTS_ZSTD
+extern int zstd_member_workspacesize(void);
+extern size_t zstd_member_bound(size_t);
+extern ssize_t zstd_member(void *, const void *, size_t, void *, size_t);
+#endif
+
+// merkle.c
+#ifdef LIME_SUPPORTS_MERKLE
+extern int merkle_init(int);
+extern int merkle_update(void *, size_t);
+extern int merkle_final(u8 *);
+extern int merkle_write_tcp(void);
+extern int merkle_write_disk(void);
+extern void merkle_clean(void);
+#endif
+
+// parallel.c
+#ifdef LIME_SUPPORTS_THREADS
+extern int parallel_start(int, int);
+extern void parallel_stop(void);
+extern void parallel_range(resource_size_t, resource_size_t, ssize_t (*)(void *, size_t));
+#endif
+
+// stats.c
+#ifdef LIME_SUPPORTS_STATS
+extern int stats_start(u64);
+extern void stats_stop(void);
+extern void stats_range(resource_size_t, resource_size_t);
+extern void stats_tick(void);
+extern void stats_done(void);
+#endif
+
+// control.c
+#ifdef LIME_SUPPORTS_CONTROL
+extern int control_start(int, int (*)(void));
+extern void control_stop(void);
+extern int lime_checkpoint(void);
+extern int lime_cancelled(void);
+extern unsigned long lime_resumes(void);
+#else
+static inline int lime_checkpoint(void) { return 0; }
+static inline int lime_cancelled(void) { return 0; }
+static inline unsigned long lime_resumes(void) { return 0; }
+#endif
+
+// delta.c
+#ifdef LIME_SUPPORTS_DELTA
+extern int delta_add_range(resource_size_t, resource_size_t);
+extern int delta_start(char *);
+extern void delta_record(unsigned long, const void *);
+extern int delta_changed(unsigned long);
+extern int delta_write_tcp(void);
+extern int delta_write_disk(void);
+extern void delta_stop(void);
+#endif
+
+// dedup.c
+#ifdef LIME_SUPPORTS_DEDUP
+extern int dedup_start(int);
+extern int dedup_find(const void *, resource_size_t, resource_size_t *);
+extern void dedup_stop(void);
+#endif
+
+// budget.c
+#ifdef LIME_SUPPORTS_TIMING
+extern resource_size_t budget_check(struct lime_budget *, resource_size_t);
+extern void budget_stall(u64);
+extern void budget_stall_begin(void);
+extern void budget_stall_end(void);
+extern void skipmap_add(resource_size_t, resource_size_t, long long);
+extern void skipmap_retry(ssize_t (*)(void *, size_t, loff_t), void *);
+extern int skipmap_empty(void);
+extern int skipmap_write_disk(void);
+extern void skipmap_clean(void);
+
+/* Bytes to pad at addr instead of reading, or 0 to read it. */
+static inline resource_size_t lime_budget(struct lime_budget *b, resource_size_t addr) {
+    if (likely(addr >= b->skip_end && addr < b->next && ++b->pages % LIME_BUDGET_STRIDE))
+        return 0;
+    return budget_check(b, addr);
+}
+#else
+static inline resource_size_t lime_budget(struct lime_budget *b, resource_size_t addr) { return 0; }
+static inline void skipmap_add(resource_size_t addr, resource_size_t len, long long off) { }
+static inline void budget_stall(u64 ns) { }
+static inline void budget_stall_begin(void) { }
+static inline void budget_stall_end(void) { }
+#endif
+
+// throttle.c
+#ifdef LIME_SUPPORTS_THROTTLE
+extern void throttle_start(int, int);
+extern void throttle_write(size_t);
+extern void throttle_begin(struct lime_duty *);
+extern void throttle_cpu(struct lime_duty *);
+#else
+static inline void throttle_write(size_t n) { }
+static inline void throttle_begin(struct lime_duty *d) { }
+static inline void throttle_cpu(struct lime_duty *d) { cond_resched(); }
+#endif
+
+// filter.c
+#ifdef LIME_SUPPORTS_FILTER
+extern void filter_start(int);
+extern unsigned long filter_page(unsigned long);
+#else
+static inline unsigned long filter_page(unsigned long pfn) { return 0; }
+#endif
+
+/* Bytes from addr on, at most left, that exclude= leaves out; 0 to read addr. */
+static inline resource_size_t lime_excluded(resource_size_t addr, resource_size_t left) {
+    unsigned long n = filter_page(addr >> PAGE_SHIFT);
+
+    if (likely(!n))
+        return 0;
+
+    left = min((resource_size_t) n << PAGE_SHIFT, left);
+    lime_stat_add(excluded, left);
+    return left;
+}
+
+// compress.c
+#ifdef LIME_SUPPORTS_COMPRESS_THREADS
+extern int compress_start(int, int);
+extern void compress_stop(void);
+extern ssize_t compress_write(const void *, size_t, ssize_t (*)(void *, ssize_t));
+extern ssize_t compress_sync(ssize_t (*)(void *, ssize_t));
+extern ssize_t compress_flush(ssize_t (*)(void *, ssize_t));
+#endif
 
 // structures
 
@@ -135,6 +598,41 @@ typedef struct {
     unsigned char reserved[8];
 } __attribute__ ((__packed__)) lime_mem_range_header;
 
+typedef struct {
+    unsigned long long s_addr;
+    unsigned long long offset;
+    unsigned int length;
+    unsigned int flags;
+} __attribute__ ((__packed__)) lime_index_entry;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long offset;
+    unsigned long long count;
+    unsigned char reserved[8];
+} __attribute__ ((__packed__)) lime_index_trailer;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int length;
+    unsigned long long seq;
+} __attribute__ ((__packed__)) lime_stream_header;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int page_size;
+    unsigned int nranges;
+    unsigned long long npages;
+    unsigned char reserved[8];
+} __attribute__ ((__packed__)) lime_fp_header;
+
+typedef struct {
+    unsigned long long s_pfn;
+    unsigned long long npages;
+} __attribute__ ((__packed__)) lime_fp_range;
+
 
 
 #endif //__LIME_H_
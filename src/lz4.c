@@ -0,0 +1,115 @@
+/*
+ * LiME - Linux Memory Extractor
+ * Copyright (c) 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ *
+ * Author:
+ * Joe T. Sylve, Ph.D.       - joe.sylve@gmail.com, @jtsylve
+ *
+ * SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "lime.h"
+
+#if defined(LIME_SUPPORTS_LZ4) || defined(LIME_SUPPORTS_LZ4HC)
+#include <linux/lz4.h>
+
+/*
+ * Each chunk becomes one LZ4 frame holding a single block, so the output
+ * decodes with the stock lz4 tool.  The frame descriptor is fixed
+ * (independent blocks, 1 MB maximum block size, no checksums), which
+ * makes its header checksum byte a constant.
+ */
+#define LZ4_FRAME_HEADER_SIZE   7
+#define LZ4_BLOCK_HEADER_SIZE   4
+#define LZ4_ENDMARK_SIZE        4
+#define LZ4_FRAME_OVERHEAD      (LZ4_FRAME_HEADER_SIZE + LZ4_BLOCK_HEADER_SIZE + LZ4_ENDMARK_SIZE)
+#define LZ4_BLOCK_UNCOMPRESSED  0x80000000U
+
+static const u8 lz4_frame_header[LZ4_FRAME_HEADER_SIZE] = {
+    0x04, 0x22, 0x4d, 0x18,     /* magic */
+    0x60,                       /* FLG: version 01, block independence */
+    0x60,                       /* BD: 1 MB maximum block size */
+    0x51,                       /* HC: (xxh32(FLG BD) >> 8) & 0xff */
+};
+
+size_t lz4_member_bound(size_t inlen)
+{
+    return LZ4_COMPRESSBOUND(inlen) + LZ4_FRAME_OVERHEAD;
+}
+
+static ssize_t lz4_frame(const void *in, size_t inlen, u8 *o, int n)
+{
+    u8 *block = o + LZ4_FRAME_HEADER_SIZE;
+
+    memcpy(o, lz4_frame_header, LZ4_FRAME_HEADER_SIZE);
+
+    /* The format allows incompressible data to be stored as is. */
+    if (n <= 0 || n >= inlen) {
+        memcpy(block + LZ4_BLOCK_HEADER_SIZE, in, inlen);
+        lime_put_le32(block, inlen | LZ4_BLOCK_UNCOMPRESSED);
+        n = inlen;
+    } else {
+        lime_put_le32(block, n);
+    }
+
+    lime_put_le32(block + LZ4_BLOCK_HEADER_SIZE + n, 0);
+
+    return LZ4_FRAME_OVERHEAD + n;
+}
+
+#ifdef LIME_SUPPORTS_LZ4
+int lz4_member_workspacesize(void)
+{
+    return LZ4_MEM_COMPRESS;
+}
+
+ssize_t lz4_member(void *ws, const void *in, size_t inlen, void *out, size_t outlen)
+{
+    int n;
+
+    if (inlen > LIME_CHUNK_SIZE || outlen < lz4_member_bound(inlen))
+        return -EINVAL;
+
+    n = LZ4_compress_default(in, (char *) out + LZ4_FRAME_HEADER_SIZE + LZ4_BLOCK_HEADER_SIZE,
+                             inlen, inlen, ws);
+
+    return lz4_frame(in, inlen, out, n);
+}
+#endif
+
+#ifdef LIME_SUPPORTS_LZ4HC
+int lz4hc_member_workspacesize(void)
+{
+    return LZ4HC_MEM_COMPRESS;
+}
+
+ssize_t lz4hc_member(void *ws, const void *in, size_t inlen, void *out, size_t outlen)
+{
+    int n;
+
+    if (inlen > LIME_CHUNK_SIZE || outlen < lz4_member_bound(inlen))
+        return -EINVAL;
+
+    n = LZ4_compress_HC(in, (char *) out + LZ4_FRAME_HEADER_SIZE + LZ4_BLOCK_HEADER_SIZE,
+                        inlen, inlen, LZ4HC_DEFAULT_CLEVEL, ws);
+
+    return lz4_frame(in, inlen, out, n);
+}
+#endif
+
+#endif
@@ -28,12 +28,40 @@
 static ssize_t write_lime_header(struct resource *);
 static ssize_t write_padding(size_t);
 static void write_range(struct resource *);
+static void write_range_sparse(struct resource *);
+static ssize_t write_hole(size_t);
+static ssize_t sparse_flush(void);
+static unsigned long count_blocks(void);
+#ifdef LIME_SUPPORTS_STATS
+static u64 ram_size(void);
+#endif
+#ifdef LIME_SUPPORTS_DELTA
+static int fp_start(void);
+#endif
+#ifdef LIME_SUPPORTS_PREALLOC
+static int prescan_output(void);
+#endif
+static ssize_t write_block_header(struct resource *);
+static void write_range_blocks(struct resource *);
+static ssize_t write_block_index(void);
+static ssize_t write_indexed(void *, ssize_t);
 static int init(void);
+static void update_digest(void *, size_t);
+#ifdef LIME_SUPPORTS_COMPRESS
+static int compress_alg(const char *);
+#endif
 static ssize_t write_vaddr(void *, size_t);
+static ssize_t write_buffered(void *, size_t);
+static ssize_t write_page(unsigned long);
+static void * page_buffer(void);
+static long long skip_offset(void);
+static int page_filled(const void *, unsigned long *);
+static ssize_t stage_flush(void);
 static ssize_t write_flush(void);
 static ssize_t try_write(void *, ssize_t);
+static ssize_t write_sink(void *, size_t);
 static int setup(void);
-static void cleanup(void);
+static int cleanup(void);
 
 /*
  * Helpers for walking the iomem_resource tree depth-first.
@@ -87,10 +115,20 @@ static inline int lime_is_ram(struct resource *r)
 
 static char * format = NULL;
 static int mode = 0;
-static int method = 0;
+int method = 0;
 
 static void * vpage;
 
+static void * stage;
+static void * stage_spare;
+static size_t stage_len;
+static size_t stage_size;
+#ifdef LIME_SUPPORTS_THREADS
+/* Digest queue positions past the current and the spare staging buffer. */
+static unsigned long stage_mark;
+static unsigned long spare_mark;
+#endif
+
 #ifdef LIME_SUPPORTS_DEFLATE
 static void *deflate_page_buf;
 #endif
@@ -98,6 +136,7 @@ static void *deflate_page_buf;
 char * path = NULL;
 static int dio = 0;
 int port = 0;
+unsigned int cid = 0;
 int localhostonly = 0;
 
 char * digest = NULL;
@@ -110,17 +149,156 @@ module_param(localhostonly, int, S_IRUGO);
 module_param(digest, charp, S_IRUGO);
 
 #ifdef LIME_SUPPORTS_TIMING
-static long timeout = 1000;
+long timeout = 1000;
 module_param(timeout, long, S_IRUGO);
+
+static int retry = 0;
+module_param(retry, int, S_IRUGO);
 #endif
 
-#ifdef LIME_SUPPORTS_DEFLATE
-static int compress = 0;
-module_param(compress, int, S_IRUGO);
+#ifdef LIME_SUPPORTS_THREADS
+static int threads = 0;
+module_param(threads, int, S_IRUGO);
+
+static int digest_async = 0;
+module_param(digest_async, int, S_IRUGO);
+
+static int numa = 0;
+module_param(numa, int, S_IRUGO);
+#endif
+
+#ifdef LIME_SUPPORTS_THREADS
+static int streams = 0;
+module_param(streams, int, S_IRUGO);
+#endif
+
+#ifdef LIME_SUPPORTS_MERKLE
+int merkle = 0;
+module_param(merkle, int, S_IRUGO);
+#endif
+
+static int bufsize = 0;
+module_param(bufsize, int, S_IRUGO);
+
+#ifdef LIME_SUPPORTS_AIO_DIO
+int dio_depth = 0;
+module_param(dio_depth, int, S_IRUGO);
+#endif
+
+static int sparse = 0;
+module_param(sparse, int, S_IRUGO);
+
+#ifdef LIME_SUPPORTS_LOWCACHE
+static int lowcache = 0;
+module_param(lowcache, int, S_IRUGO);
+#endif
+
+#ifdef LIME_SUPPORTS_LOWCACHE_STORES
+/* Page each CPU copies through before storing around the cache */
+static void __percpu * bounce;
+#endif
+
+#ifdef LIME_SUPPORTS_PREALLOC
+static int prescan = 0;
+module_param(prescan, int, S_IRUGO);
+#endif
+
+#ifdef LIME_SUPPORTS_FILTER
+static int exclude = 0;
+module_param(exclude, int, S_IRUGO);
+#endif
+
+#ifdef LIME_SUPPORTS_THROTTLE
+static int max_rate = 0;
+module_param(max_rate, int, S_IRUGO);
+
+static int max_cpu = 0;
+module_param(max_cpu, int, S_IRUGO);
+#endif
+
+#ifdef LIME_SUPPORTS_CONTROL
+static int background = 0;
+module_param(background, int, S_IRUGO);
+#endif
+
+#ifdef LIME_SUPPORTS_DELTA
+static char * baseline = NULL;
+module_param(baseline, charp, S_IRUGO);
+
+static int fingerprint = 0;
+module_param(fingerprint, int, S_IRUGO);
+#endif
+
+#ifdef LIME_SUPPORTS_DEDUP
+static int dedup = 0;
+module_param(dedup, int, S_IRUGO);
+#endif
+
+/* Pending run of data pages, same-filled pages and duplicates in lime sparse mode. */
+static void * run_buf;
+static resource_size_t run_start;
+static size_t run_len;
+static resource_size_t fill_start;
+static resource_size_t fill_len;
+static unsigned long fill_val;
+static resource_size_t ref_start;
+static resource_size_t ref_len;
+static resource_size_t ref_src;
+
+/* lime2 block index; entries are added as blocks are queued and completed as they are written. */
+static lime_index_entry * block_index;
+static unsigned long nblocks;
+static unsigned long nindexed;
+static unsigned long nemitted;
+static resource_size_t block_addr;
+static void * block_buf;
+
+/* Bytes written to the sink so far. */
+static unsigned long long out_pos;
+
+#ifdef LIME_SUPPORTS_COMPRESS
+static char * compress_name = NULL;
+module_param_named(compress, compress_name, charp, S_IRUGO);
+
+static int compress = LIME_COMPRESS_NONE;
+
+static int compress_threads = 0;
+#ifdef LIME_SUPPORTS_COMPRESS_THREADS
+module_param(compress_threads, int, S_IRUGO);
+#endif
+
+/* lime2 index flags for the frames each algorithm writes; LZ4HC writes LZ4 frames. */
+static const unsigned int block_flags[] = {
+    [LIME_COMPRESS_NONE] = 0,
+    [LIME_COMPRESS_DEFLATE] = LIME_BLOCK_GZIP,
+    [LIME_COMPRESS_LZ4] = LIME_BLOCK_LZ4,
+    [LIME_COMPRESS_ZSTD] = LIME_BLOCK_ZSTD,
+    [LIME_COMPRESS_LZ4HC] = LIME_BLOCK_LZ4,
+};
+#endif
+
+#ifdef LIME_SUPPORTS_ZEROCOPY
+static int zerocopy = 0;
+module_param(zerocopy, int, S_IRUGO);
+
+static struct page * zc_pages[LIME_ZEROCOPY_BATCH];
+static unsigned int zc_count;
+
+static ssize_t zerocopy_flush(void);
+#endif
+
+#ifdef LIME_SUPPORTS_DIRECT_RUN
+/* Whether read_run() may stand in for read_page() over whole runs */
+static int direct_runs;
+
+/* Where write_range() copies a run when there is no staging buffer. */
+static void * run_copy;
 #endif
 
 static int __init lime_init_module (void)
 {
+    int err;
+
     if(!path) {
         DBG("No path parameter specified");
         return -EINVAL;
@@ -134,34 +312,194 @@ static int __init lime_init_module (void)
     DBG("Parameters");
     DBG("  PATH: %s", path);
     DBG("  DIO: %u", dio);
+#ifdef LIME_SUPPORTS_AIO_DIO
+    DBG("  DIO_DEPTH: %u", dio_depth);
+#endif
     DBG("  FORMAT: %s", format);
     DBG("  LOCALHOSTONLY: %u", localhostonly);
     DBG("  DIGEST: %s", digest);
+    DBG("  BUFSIZE: %u", bufsize);
+    DBG("  SPARSE: %u", sparse);
+#ifdef LIME_SUPPORTS_PREALLOC
+    DBG("  PRESCAN: %u", prescan);
+#endif
+#ifdef LIME_SUPPORTS_LOWCACHE
+    DBG("  LOWCACHE: %u", lowcache);
+#endif
+#ifdef LIME_SUPPORTS_FILTER
+    DBG("  EXCLUDE: %u", exclude);
+#endif
+#ifdef LIME_SUPPORTS_THROTTLE
+    DBG("  MAX_RATE: %u", max_rate);
+    DBG("  MAX_CPU: %u", max_cpu);
+#endif
+#ifdef LIME_SUPPORTS_CONTROL
+    DBG("  BACKGROUND: %u", background);
+#endif
+#ifdef LIME_SUPPORTS_DELTA
+    DBG("  FINGERPRINT: %u", fingerprint);
+    DBG("  BASELINE: %s", baseline);
+#endif
+#ifdef LIME_SUPPORTS_DEDUP
+    DBG("  DEDUP: %u", dedup);
+#endif
 
 #ifdef LIME_SUPPORTS_TIMING
     DBG("  TIMEOUT: %lu", timeout);
+    DBG("  RETRY: %u", retry);
 #endif
 
-#ifdef LIME_SUPPORTS_DEFLATE
-    DBG("  COMPRESS: %u", compress);
+#ifdef LIME_SUPPORTS_COMPRESS
+    DBG("  COMPRESS: %s", compress_name);
+#endif
+
+#ifdef LIME_SUPPORTS_COMPRESS_THREADS
+    DBG("  COMPRESS_THREADS: %u", compress_threads);
+#endif
+
+#ifdef LIME_SUPPORTS_THREADS
+    DBG("  THREADS: %u", threads);
+    DBG("  DIGEST_ASYNC: %u", digest_async);
+    DBG("  NUMA: %u", numa);
+#endif
+
+#ifdef LIME_SUPPORTS_THREADS
+    DBG("  STREAMS: %u", streams);
+#endif
+
+#ifdef LIME_SUPPORTS_MERKLE
+    DBG("  MERKLE: %u", merkle);
+#endif
+
+#ifdef LIME_SUPPORTS_ZEROCOPY
+    DBG("  ZEROCOPY: %u", zerocopy);
 #endif
 
     if (!strcmp(format, "raw")) mode = LIME_MODE_RAW;
     else if (!strcmp(format, "lime")) mode = LIME_MODE_LIME;
     else if (!strcmp(format, "padded")) mode = LIME_MODE_PADDED;
+    else if (!strcmp(format, "lime2")) mode = LIME_MODE_LIME2;
     else {
         DBG("Invalid format parameter specified.");
         return -EINVAL;
     }
 
-    method = (sscanf(path, "tcp:%d", &port) == 1) ? LIME_METHOD_TCP : LIME_METHOD_DISK;
+    if (sscanf(path, "tcp:%d", &port) == 1)
+        method = LIME_METHOD_TCP;
+    else if (sscanf(path, "vsock:%u:%d", &cid, &port) == 2)
+        method = LIME_METHOD_VSOCK;
+    else if (!strncmp(path, "blk:", 4))
+        method = LIME_METHOD_BLK;
+    else
+        method = LIME_METHOD_DISK;
+
+#ifndef LIME_SUPPORTS_VSOCK
+    if (method == LIME_METHOD_VSOCK) {
+        DBG("vsock: output requires kernel >= 4.2");
+        return -EINVAL;
+    }
+#endif
+
+    if (method == LIME_METHOD_BLK) {
+#ifdef LIME_SUPPORTS_BLK
+        // There is no filesystem to put a sidecar on
+        if (digest) {
+            DBG("Digest not supported with blk: output");
+            return -EINVAL;
+        }
+#else
+        DBG("blk: output requires kernel >= 5.18");
+        return -EINVAL;
+#endif
+    }
+
+#ifdef LIME_SUPPORTS_DELTA
+    if (baseline)
+        fingerprint = 1;
+
+    // Only lime records can describe an image with pages left out
+    if (baseline && mode != LIME_MODE_LIME) {
+        DBG("baseline requires format=lime");
+        return -EINVAL;
+    }
+
+    if (fingerprint && method == LIME_METHOD_BLK) {
+        DBG("Fingerprints not supported with blk: output");
+        return -EINVAL;
+    }
+#endif
+
+#ifdef LIME_SUPPORTS_DEDUP
+    if (dedup > 0 && mode != LIME_MODE_LIME) {
+        DBG("dedup requires format=lime");
+        return -EINVAL;
+    }
+#endif
+
+#ifdef LIME_SUPPORTS_COMPRESS
+    if ((compress = compress_alg(compress_name)) < 0) {
+        DBG("Invalid or unsupported compress parameter specified.");
+        return -EINVAL;
+    }
+#endif
+
+#ifdef LIME_SUPPORTS_CONTROL
+    // The kernel thread resolves relative paths against / and not the cwd of insmod
+    if (background && !LIME_METHOD_IS_SOCKET(method) &&
+        path[method == LIME_METHOD_BLK ? 4 : 0] != '/') {
+        DBG("background=1 requires an absolute path");
+        return -EINVAL;
+    }
+#endif
+
+#ifdef LIME_SUPPORTS_CONTROL
+    err = control_start(background, init);
+#else
+    err = init();
+#endif
+
+    // The module is not kept loaded, so its sysfs files go with it
+    if (err) {
+#ifdef LIME_SUPPORTS_CONTROL
+        control_stop();
+#endif
+#ifdef LIME_SUPPORTS_STATS
+        stats_stop();
+#endif
+    }
+
+    return err;
+}
 
-    return init();
+#ifdef LIME_SUPPORTS_COMPRESS
+/* Map the compress parameter to an algorithm; "1" is kept for deflate. */
+static int compress_alg(const char * name) {
+    if (!name || !strcmp(name, "0"))
+        return LIME_COMPRESS_NONE;
+#ifdef LIME_SUPPORTS_DEFLATE
+    if (!strcmp(name, "1") || !strcmp(name, "deflate"))
+        return LIME_COMPRESS_DEFLATE;
+#endif
+#ifdef LIME_SUPPORTS_LZ4
+    if (!strcmp(name, "lz4"))
+        return LIME_COMPRESS_LZ4;
+#endif
+#ifdef LIME_SUPPORTS_LZ4HC
+    if (!strcmp(name, "lz4hc"))
+        return LIME_COMPRESS_LZ4HC;
+#endif
+#ifdef LIME_SUPPORTS_ZSTD
+    if (!strcmp(name, "zstd"))
+        return LIME_COMPRESS_ZSTD;
+#endif
+    return -1;
 }
+#endif
 
 static int init(void) {
     struct resource *p;
     int err = 0;
+    int ret;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
     resource_size_t p_last = -1;
 #else
@@ -170,15 +508,163 @@ static int init(void) {
 
     DBG("Initializing Dump...");
 
+#ifdef LIME_SUPPORTS_STATS
+    if (stats_start(ram_size()) < 0)
+        DBG("Progress stats unavailable");
+#endif
+
     if ((err = setup())) {
         DBG("Setup Error");
         cleanup();
         return err;
     }
 
+#ifdef LIME_SUPPORTS_THROTTLE
+    // After setup, so waiting for a connection earns no credit
+    throttle_start(max_rate, max_cpu);
+#endif
+
     if (digest)
         compute_digest = ldigest_init();
 
+#ifdef LIME_SUPPORTS_MERKLE
+    /* Chunk hashing already runs off the writing thread. */
+    if (merkle > 0)
+        digest_async = 0;
+#endif
+
+#ifdef LIME_SUPPORTS_THREADS
+    if (digest_async && compute_digest == LIME_DIGEST_COMPUTE && ldigest_async_start() < 0) {
+        DBG("Hashing on the writing thread instead");
+        digest_async = 0;
+    }
+#endif
+
+    if (mode == LIME_MODE_LIME2 && sparse) {
+        DBG("Sparse disabled: not supported with lime2");
+        sparse = 0;
+    }
+
+#ifdef LIME_SUPPORTS_COMPRESS
+    /*
+     * Only deflate has a single-stream mode.  Other algorithms, and lime2
+     * which compresses each block on its own, always use the worker pool.
+     */
+    if (compress && (compress != LIME_COMPRESS_DEFLATE || mode == LIME_MODE_LIME2)) {
+#ifdef LIME_SUPPORTS_COMPRESS_THREADS
+        if (compress_threads <= 0)
+            compress_threads = 1;
+#else
+        DBG("Chunked compression requires kernel >= 3.19, and CONFIG_CRC32 for deflate");
+        err = -EINVAL;
+        goto err_digest;
+#endif
+    }
+#endif
+
+    /*
+     * lime output describes filled pages with their own records; raw and
+     * padded output can only leave holes in a file it writes verbatim.
+     */
+    if (sparse && mode != LIME_MODE_LIME && (method != LIME_METHOD_DISK
+#ifdef LIME_SUPPORTS_COMPRESS
+                                             || compress
+#endif
+                                             )) {
+        DBG("Sparse disabled: raw and padded output require uncompressed disk output");
+        sparse = 0;
+    }
+#ifdef LIME_SUPPORTS_THREADS
+    if (sparse && threads > 0) {
+        DBG("Sparse disabled: not supported with threads");
+        sparse = 0;
+    }
+#endif
+
+#ifdef LIME_SUPPORTS_DELTA
+#ifdef LIME_SUPPORTS_THREADS
+    // Unchanged pages are left out by the sparse writer, which has no threaded path
+    if (baseline && threads > 0) {
+        DBG("Threads disabled: not supported with baseline");
+        threads = 0;
+    }
+#endif
+
+    if (fingerprint && (err = fp_start()) < 0) {
+        DBG("Failed to set up fingerprints: %d", err);
+        goto err_digest;
+    }
+#endif
+
+#ifdef LIME_SUPPORTS_DEDUP
+#ifdef LIME_SUPPORTS_THREADS
+    if (dedup > 0 && threads > 0) {
+        DBG("Threads disabled: not supported with dedup");
+        threads = 0;
+    }
+#endif
+
+    if (dedup > 0 && (err = dedup_start(dedup)) < 0)
+        goto err_digest;
+#endif
+
+#ifdef LIME_SUPPORTS_FILTER
+#ifdef LIME_SUPPORTS_THREADS
+    // Excluded pages leave holes in lime output only through the sparse writer
+    if (exclude && mode == LIME_MODE_LIME && threads > 0) {
+        DBG("Threads disabled: not supported with exclude and format=lime");
+        threads = 0;
+    }
+#endif
+
+    filter_start(exclude);
+#endif
+
+#ifdef LIME_SUPPORTS_ZEROCOPY
+    /* Pages can only bypass the copy when nothing else needs their bytes. */
+    if (zerocopy && (method != LIME_METHOD_TCP || compute_digest == LIME_DIGEST_COMPUTE || sparse
+#ifdef LIME_SUPPORTS_COMPRESS
+                     || compress
+#endif
+#ifdef LIME_SUPPORTS_THREADS
+                     || threads > 0 || streams > 1
+#endif
+#ifdef LIME_SUPPORTS_DELTA
+                     || fingerprint
+#endif
+                     )) {
+        DBG("Zero-copy disabled: requires single-stream TCP output without digest, fingerprints, compression, threads or sparse");
+        zerocopy = 0;
+    }
+#endif
+
+#ifdef LIME_SUPPORTS_TIMING
+    /* Skipped regions are rewritten in place, so the file must hold their padding as written. */
+    if (retry && (method != LIME_METHOD_DISK || compute_digest == LIME_DIGEST_COMPUTE || sparse || dio
+#ifdef LIME_SUPPORTS_COMPRESS
+                  || compress
+#endif
+#ifdef LIME_SUPPORTS_MERKLE
+                  || merkle > 0
+#endif
+                  )) {
+        DBG("Retry disabled: requires uncompressed disk output without dio, digest or sparse");
+        retry = 0;
+    }
+#endif
+
+#ifdef LIME_SUPPORTS_DIRECT_RUN
+    /* Prefetching and page classes look at one page at a time. */
+    direct_runs = 1
+#ifdef LIME_SUPPORTS_LOWCACHE
+                  && !lowcache
+#endif
+#ifdef LIME_SUPPORTS_FILTER
+                  && !exclude
+#endif
+                  ;
+#endif
+
     vpage = (void *) __get_free_page(GFP_NOIO);
     if (!vpage) {
         DBG("Failed to allocate page");
@@ -186,13 +672,116 @@ static int init(void) {
         goto err_digest;
     }
 
+#ifdef LIME_SUPPORTS_LOWCACHE_STORES
+    if (lowcache) {
+        bounce = __alloc_percpu(PAGE_SIZE, PAGE_SIZE);
+        if (!bounce) {
+            DBG("Failed to allocate lowcache pages");
+            err = -ENOMEM;
+            goto err_vpage;
+        }
+    }
+#endif
+
+    if (bufsize > 0)
+        stage_size = (size_t) min(bufsize, LIME_MAX_BUFSIZE) << 20;
+#ifdef LIME_SUPPORTS_THREADS
+    // The digest thread hashes staging buffers in place, so it needs some
+    else if (digest_async)
+        stage_size = 2 * LIME_CHUNK_SIZE;
+#endif
+
+    if (stage_size) {
+        stage = vmalloc(stage_size);
+        if (!stage) {
+            DBG("Failed to allocate %zu byte staging buffer", stage_size);
+            err = -ENOMEM;
+            goto err_vpage;
+        }
+
+        // blk: bios and the digest thread read the staging pages, so
+        // fill a second buffer while they are still at the first
+        if (method == LIME_METHOD_BLK
+#ifdef LIME_SUPPORTS_THREADS
+            || digest_async
+#endif
+            ) {
+            stage_spare = vmalloc(stage_size);
+            if (!stage_spare) {
+                DBG("Failed to allocate %zu byte staging buffer", stage_size);
+                err = -ENOMEM;
+                goto err_stage;
+            }
+        }
+    }
+
+    if (mode == LIME_MODE_LIME && (sparse
+#ifdef LIME_SUPPORTS_DELTA
+                                   || baseline
+#endif
+#ifdef LIME_SUPPORTS_DEDUP
+                                   || dedup > 0
+#endif
+#ifdef LIME_SUPPORTS_FILTER
+                                   || exclude
+#endif
+                                   )) {
+        run_buf = vmalloc(LIME_CHUNK_SIZE);
+        if (!run_buf) {
+            DBG("Failed to allocate sparse run buffer");
+            err = -ENOMEM;
+            goto err_stage;
+        }
+    }
+
+    if (mode == LIME_MODE_LIME2) {
+        nblocks = count_blocks();
+        nindexed = nemitted = 0;
+        block_index = vmalloc(nblocks * sizeof(lime_index_entry));
+        block_buf = vmalloc(LIME_CHUNK_SIZE);
+        if (!block_index || !block_buf) {
+            DBG("Failed to allocate lime2 index for %lu blocks", nblocks);
+            err = -ENOMEM;
+            goto err_stage;
+        }
+    }
+
+#ifdef LIME_SUPPORTS_DIRECT_RUN
+    // Threads, lime2 and sparse lime output copy runs into buffers of their own
+    if (direct_runs && !stage && !run_buf && mode != LIME_MODE_LIME2
+#ifdef LIME_SUPPORTS_THREADS
+        && threads <= 0
+#endif
+        ) {
+        run_copy = vmalloc(LIME_CHUNK_SIZE);
+        if (!run_copy) {
+            DBG("Failed to allocate run buffer");
+            err = -ENOMEM;
+            goto err_stage;
+        }
+    }
+#endif
+
+#ifdef LIME_SUPPORTS_PREALLOC
+    if (prescan > 0 && method == LIME_METHOD_DISK && (err = prescan_output()) < 0)
+        goto err_stage;
+#endif
+
+#ifdef LIME_SUPPORTS_COMPRESS_THREADS
+    if (compress && compress_threads > 0) {
+        err = compress_start(compress_threads, compress);
+        if (err < 0)
+            goto err_stage;
+    }
+#endif
+
 #ifdef LIME_SUPPORTS_DEFLATE
-    if (compress) {
+    if (compress && compress_threads <= 0) {
         deflate_page_buf = kmalloc(PAGE_SIZE, GFP_NOIO);
         if (!deflate_page_buf) {
             DBG("Failed to allocate deflate buffer");
             err = -ENOMEM;
-            goto err_vpage;
+            goto err_stage;
         }
         err = deflate_begin_stream(deflate_page_buf, PAGE_SIZE);
         if (err < 0) {
@@ -202,6 +791,14 @@ static int init(void) {
     }
 #endif
 
+#ifdef LIME_SUPPORTS_THREADS
+    if (threads > 0) {
+        err = parallel_start(threads, numa);
+        if (err < 0)
+            goto err_threads;
+    }
+#endif
+
     for (p = iomem_resource.child; p; ) {
 
         if (!lime_is_ram(p)) {
@@ -210,7 +807,19 @@ static int init(void) {
             continue;
         }
 
-        if (mode == LIME_MODE_LIME && write_lime_header(p) < 0) {
+        if (lime_checkpoint()) {
+            DBG("Dump cancelled");
+            break;
+        }
+
+#ifdef LIME_SUPPORTS_STATS
+        stats_range(p->start, p->end);
+#endif
+
+        if (mode == LIME_MODE_LIME2 && write_block_header(p) < 0) {
+            DBG("Error writing header 0x%llx - 0x%llx", (unsigned long long) p->start, (unsigned long long) p->end);
+            break;
+        } else if (mode == LIME_MODE_LIME && !run_buf && write_lime_header(p) < 0) {
             DBG("Error writing header 0x%llx - 0x%llx", (unsigned long long) p->start, (unsigned long long) p->end);
             break;
         } else if (mode == LIME_MODE_PADDED && write_padding((size_t) ((p->start - 1) - p_last)) < 0) {
@@ -218,7 +827,12 @@ static int init(void) {
             break;
         }
 
-        write_range(p);
+        if (mode == LIME_MODE_LIME2)
+            write_range_blocks(p);
+        else if (run_buf)
+            write_range_sparse(p);
+        else
+            write_range(p);
 
         p_last = p->end;
 
@@ -228,9 +842,39 @@ static int init(void) {
 
     write_flush();
 
+    if (mode == LIME_MODE_LIME2 && write_block_index() < 0)
+        DBG("Error writing lime2 index");
+
+#ifdef LIME_SUPPORTS_THREADS
+    if (threads > 0)
+        parallel_stop();
+#endif
+
+#ifdef LIME_SUPPORTS_COMPRESS_THREADS
+    compress_stop();
+#endif
+
+#ifdef LIME_SUPPORTS_THREADS
+    if (digest_async && compute_digest == LIME_DIGEST_COMPUTE)
+        compute_digest = ldigest_async_stop();
+#endif
+
+#ifdef LIME_SUPPORTS_TIMING
+    if (retry && !skipmap_empty()) {
+        DBG("Retrying skipped regions");
+        skipmap_retry(write_at_disk, vpage);
+    }
+#endif
+
     DBG("Memory Dump Complete...");
 
-    cleanup();
+    // Output still buffered or in flight may fail to go out
+    if ((ret = cleanup()) < 0)
+        DBG("Error finishing output: %d", ret);
+
+#ifdef LIME_SUPPORTS_STATS
+    stats_done();
+#endif
 
     if (compute_digest == LIME_DIGEST_COMPUTE) {
         DBG("Writing Out Digest.");
@@ -238,7 +882,7 @@ static int init(void) {
         compute_digest = ldigest_final();
 
         if (compute_digest == LIME_DIGEST_COMPLETE) {
-            if (method == LIME_METHOD_TCP)
+            if (LIME_METHOD_IS_SOCKET(method))
                 err = ldigest_write_tcp();
             else
                 err = ldigest_write_disk();
@@ -250,25 +894,96 @@ static int init(void) {
     if (digest)
         ldigest_clean();
 
+#ifdef LIME_SUPPORTS_DELTA
+    if (fingerprint) {
+        if (LIME_METHOD_IS_SOCKET(method))
+            err = delta_write_tcp();
+        else
+            err = delta_write_disk();
+
+        DBG("Fingerprint Write %s.", (err == 0) ? "Complete" : "Failed");
+        delta_stop();
+    }
+#endif
+
+#ifdef LIME_SUPPORTS_DEDUP
+    dedup_stop();
+#endif
+
+#ifdef LIME_SUPPORTS_TIMING
+    // There is no filesystem for blk: and no one waiting for it on a socket
+    if (method == LIME_METHOD_DISK && !skipmap_empty()) {
+        err = skipmap_write_disk();
+        DBG("Skip Map Write %s.", (err == 0) ? "Complete" : "Failed");
+    }
+    skipmap_clean();
+#endif
+
 #ifdef LIME_SUPPORTS_DEFLATE
-    if (compress) {
+    if (compress && compress_threads <= 0) {
         deflate_end_stream();
         kfree(deflate_page_buf);
     }
 #endif
 
+    vfree(block_buf);
+    vfree(block_index);
+    vfree(run_buf);
+#ifdef LIME_SUPPORTS_DIRECT_RUN
+    vfree(run_copy);
+    run_copy = NULL;
+#endif
+    vfree(stage);
+    vfree(stage_spare);
+    stage_spare = NULL;
+#ifdef LIME_SUPPORTS_LOWCACHE_STORES
+    free_percpu(bounce);
+    bounce = NULL;
+#endif
     free_page((unsigned long) vpage);
 
-    return 0;
+    return ret;
 
+#ifdef LIME_SUPPORTS_THREADS
+err_threads:
+#endif
 #ifdef LIME_SUPPORTS_DEFLATE
+    if (compress && compress_threads <= 0)
+        deflate_end_stream();
 err_deflate_buf:
     kfree(deflate_page_buf);
+#endif
+#ifdef LIME_SUPPORTS_COMPRESS_THREADS
+    compress_stop();
+#endif
+err_stage:
+    vfree(block_buf);
+    vfree(block_index);
+    vfree(run_buf);
+#ifdef LIME_SUPPORTS_DIRECT_RUN
+    vfree(run_copy);
+    run_copy = NULL;
+#endif
+    vfree(stage);
+    vfree(stage_spare);
+    stage_spare = NULL;
 err_vpage:
+#ifdef LIME_SUPPORTS_LOWCACHE_STORES
+    free_percpu(bounce);
+    bounce = NULL;
 #endif
     free_page((unsigned long) vpage);
 err_digest:
-    if (digest)
+#ifdef LIME_SUPPORTS_TIMING
+    skipmap_clean();
+#endif
+#ifdef LIME_SUPPORTS_DEDUP
+    dedup_stop();
+#endif
+#ifdef LIME_SUPPORTS_DELTA
+    delta_stop();
+#endif
+    if (digest)
         ldigest_clean();
     cleanup();
     return err;
@@ -283,19 +998,24 @@ static ssize_t write_lime_header(struct resource * res) {
     header.s_addr = res->start;
     header.e_addr = res->end;
 
-    return write_vaddr(&header, sizeof(lime_mem_range_header));
+    return write_buffered(&header, sizeof(lime_mem_range_header));
 }
 
 static ssize_t write_padding(size_t s) {
     size_t i = 0;
     ssize_t r;
 
+    lime_stat_add(padded, s);
+
+    if (sparse)
+        return (write_hole(s) < 0) ? -1 : 0;
+
     memset(vpage, 0, PAGE_SIZE);
 
     while(s -= i) {
 
         i = min((size_t) PAGE_SIZE, s);
-        r = write_vaddr(vpage, i);
+        r = write_buffered(vpage, i);
 
         if (r != i) {
             DBG("Error sending zero page: %zd", r);
@@ -306,86 +1026,902 @@ static ssize_t write_padding(size_t s) {
     return 0;
 }
 
+/*
+ * Pages from addr on that can be read as one run straight into the
+ * staging buffer, or into run_copy without one; 0 to go page by page.
+ */
+static unsigned long stage_run(resource_size_t addr, resource_size_t end) {
+#ifdef LIME_SUPPORTS_DIRECT_RUN
+    size_t room = stage ? stage_size - stage_len : (run_copy ? LIME_CHUNK_SIZE : 0);
+
+    // Sparse and zero-copy output decide what to do with each page
+    if (sparse || room < 2 * PAGE_SIZE)
+        return 0;
+#ifdef LIME_SUPPORTS_ZEROCOPY
+    if (zerocopy)
+        return 0;
+#endif
+
+    return direct_run(addr, min(end, (resource_size_t) (addr + room - 1)));
+#else
+    return 0;
+#endif
+}
+
 static void write_range(struct resource * res) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
     resource_size_t i, is;
 #else
     __PTRDIFF_TYPE__ i, is;
 #endif
-    struct page * p;
+    struct lime_budget b;
+    resource_size_t skip;
+    unsigned long n;
+    ssize_t s;
     void * v;
 
-    ssize_t s;
+    DBG("Writing range %llx - %llx.", (unsigned long long) res->start, (unsigned long long) res->end);
 
-#ifdef LIME_SUPPORTS_TIMING
-    ktime_t start,end;
+#ifdef LIME_SUPPORTS_THREADS
+    if (threads > 0) {
+        parallel_range(res->start, res->end, write_buffered);
+        return;
+    }
 #endif
 
-    DBG("Writing range %llx - %llx.", (unsigned long long) res->start, (unsigned long long) res->end);
+    budget_start(&b, res->start);
 
     for (i = res->start; i <= res->end; i += is) {
-#ifdef LIME_SUPPORTS_TIMING
-        start = ktime_get_real();
-#endif
+        if (unlikely(lime_checkpoint()))
+            break;
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
         is = min((resource_size_t) PAGE_SIZE, (resource_size_t) (res->end - i + 1));
 #else
         is = min((size_t) PAGE_SIZE, (size_t) (res->end - i + 1));
 #endif
 
-        if (is < PAGE_SIZE) {
+        if (unlikely(skip = lime_budget(&b, i))) {
+            // Too slow: pad over the skipped region and note where it went
+            is = min(skip, (resource_size_t) (res->end - i + 1));
+            skipmap_add(i, is, skip_offset());
+            write_padding(is);
+        } else if (is < PAGE_SIZE) {
             // We can't map partial pages and
             // the linux kernel doesn't use them anyway
             DBG("Padding partial page: addr 0x%llx size: %lu", (unsigned long long) i, (unsigned long) is);
             write_padding(is);
-        } else if (unlikely(!pfn_valid(i >> PAGE_SHIFT))) {
+        } else if ((n = stage_run(i, res->end))) {
+            // Straight into the staging buffer, where write_buffered() finds it,
+            // or into run_copy, which it writes out at once
+#ifdef LIME_SUPPORTS_DIRECT_RUN
+            v = stage ? (u8 *) stage + stage_len : run_copy;
+#else
+            v = (u8 *) stage + stage_len;
+#endif
+            read_run(v, i >> PAGE_SHIFT, n);
+            is = (resource_size_t) n << PAGE_SHIFT;
+            if (write_buffered(v, is) < 0) {
+                DBG("Failed to write run: addr 0x%llx. Skipping Range...", (unsigned long long) i);
+                break;
+            }
+        } else if (unlikely(!lime_pfn_valid(i >> PAGE_SHIFT))) {
             // Guard against invalid PFNs which can occur on SPARSEMEM
             // configs, during memory hotremove, or on unusual NUMA layouts
             DBG("Invalid PFN 0x%llx, writing padding", (unsigned long long)(i >> PAGE_SHIFT));
             write_padding(is);
+        } else if (unlikely(skip = lime_excluded(i, res->end - i + 1))) {
+            // Left out by exclude=: zeros, or a hole with sparse=1
+            is = skip;
+            write_padding(is);
         } else {
-            p = pfn_to_page(i >> PAGE_SHIFT);
-            v = lime_map_page(p);
-#ifdef copy_mc_to_kernel
-            {
-                unsigned long mc_err;
-                mc_err = copy_mc_to_kernel(vpage, v, PAGE_SIZE);
-                if (mc_err) {
-                    DBG("Hardware memory error at PFN 0x%llx (%lu bytes unreadable)",
-                        (unsigned long long)(i >> PAGE_SHIFT), mc_err);
-                    memset((char *)vpage + PAGE_SIZE - mc_err, 0, mc_err);
-                }
-            }
-#else
-            copy_page(vpage, v);
-#endif
-            lime_unmap_page(v, p);
-
-            s = write_vaddr(vpage, is);
+            s = write_page(i >> PAGE_SHIFT);
             if (s < 0) {
                 DBG("Failed to write page: addr 0x%llx. Skipping Range...", (unsigned long long) i);
                 break;
             }
         }
+    }
+}
 
-#ifdef LIME_SUPPORTS_TIMING
-        end = ktime_get_real();
+/*
+ * Sparse lime output.  Each range is written as a series of records:
+ * ordinary LiME records for runs of data pages and LiMF records, with no
+ * data following, for runs of pages that hold one repeated word.  The
+ * fill word is stored in the record's reserved field.  Partial pages,
+ * invalid PFNs and regions skipped on timeout become zero-filled records.
+ * With dedup, a page identical to one already written becomes a LiMD
+ * record holding the earlier page's address in the reserved field.
+ * The same writer produces differential output: given a baseline, pages
+ * unchanged since it get no record at all.  Neither do pages left out by
+ * exclude=.
+ */
+static ssize_t sparse_flush_data(void) {
+    lime_mem_range_header header;
+    ssize_t ret;
+
+    if (!run_len)
+        return 0;
+
+    memset(&header, 0, sizeof(lime_mem_range_header));
+    header.magic = LIME_MAGIC;
+    header.version = 1;
+    header.s_addr = run_start;
+    header.e_addr = run_start + run_len - 1;
+
+    run_len = 0;
+
+    if ((ret = write_buffered(&header, sizeof(lime_mem_range_header))) < 0)
+        return ret;
+
+    return write_buffered(run_buf, header.e_addr - header.s_addr + 1);
+}
+
+static ssize_t sparse_flush_fill(void) {
+    lime_mem_range_header header;
+    unsigned long long val = fill_val;
+
+    if (!fill_len)
+        return 0;
+
+    // Widen a 32-bit fill word so the field always holds 8 pattern bytes
+    if (sizeof(unsigned long) == 4)
+        val |= val << 32;
+
+    memset(&header, 0, sizeof(lime_mem_range_header));
+    header.magic = LIME_FILL_MAGIC;
+    header.version = 1;
+    header.s_addr = fill_start;
+    header.e_addr = fill_start + fill_len - 1;
+    memcpy(header.reserved, &val, sizeof(header.reserved));
+
+    fill_len = 0;
+
+    return write_buffered(&header, sizeof(lime_mem_range_header));
+}
+
+static ssize_t sparse_flush_ref(void) {
+    lime_mem_range_header header;
+    unsigned long long src = ref_src;
+
+    if (!ref_len)
+        return 0;
+
+    memset(&header, 0, sizeof(lime_mem_range_header));
+    header.magic = LIME_DEDUP_MAGIC;
+    header.version = 1;
+    header.s_addr = ref_start;
+    header.e_addr = ref_start + ref_len - 1;
+    memcpy(header.reserved, &src, sizeof(header.reserved));
+
+    ref_len = 0;
+
+    return write_buffered(&header, sizeof(lime_mem_range_header));
+}
+
+static ssize_t sparse_flush(void) {
+    ssize_t ret;
+
+    if ((ret = sparse_flush_data()) < 0)
+        return ret;
+
+    if ((ret = sparse_flush_ref()) < 0)
+        return ret;
+
+    return sparse_flush_fill();
+}
+
+static ssize_t sparse_fill(resource_size_t addr, resource_size_t len, unsigned long val) {
+    ssize_t ret;
+
+    if (fill_len && (fill_val != val || fill_start + fill_len != addr))
+        if ((ret = sparse_flush_fill()) < 0)
+            return ret;
+
+    if ((ret = sparse_flush_data()) < 0 || (ret = sparse_flush_ref()) < 0)
+        return ret;
+
+    if (!fill_len) {
+        fill_start = addr;
+        fill_val = val;
+    }
+    fill_len += len;
+
+    return 0;
+}
+
+/* The page at addr has already been read to the end of run_buf. */
+static ssize_t sparse_data(resource_size_t addr) {
+    ssize_t ret;
+
+    if ((ret = sparse_flush_fill()) < 0 || (ret = sparse_flush_ref()) < 0)
+        return ret;
+
+    if (!run_len)
+        run_start = addr;
+    run_len += PAGE_SIZE;
+
+    if (run_len == LIME_CHUNK_SIZE)
+        return sparse_flush_data();
+
+    return 0;
+}
+
+/* The page at addr repeats the one at src; consecutive repeats share a record. */
+static ssize_t sparse_ref(resource_size_t addr, resource_size_t src) {
+    ssize_t ret;
+
+    if (ref_len && (ref_start + ref_len != addr || ref_src + ref_len != src))
+        if ((ret = sparse_flush_ref()) < 0)
+            return ret;
+
+    if ((ret = sparse_flush_data()) < 0 || (ret = sparse_flush_fill()) < 0)
+        return ret;
+
+    if (!ref_len) {
+        ref_start = addr;
+        ref_src = src;
+    }
+    ref_len += PAGE_SIZE;
+
+    return 0;
+}
+
+/* Whether a page just read differs from the baseline; see delta.c. */
+static inline int page_changed(unsigned long pfn) {
+#ifdef LIME_SUPPORTS_DELTA
+    if (baseline)
+        return delta_changed(pfn);
+#endif
+    return 1;
+}
+
+/* Whether a page just read is all zeros and exclude= leaves those out. */
+static inline int page_zero_excluded(const void * v) {
+#ifdef LIME_SUPPORTS_FILTER
+    unsigned long val;
+
+    if ((exclude & LIME_EXCLUDE_ZERO) && page_filled(v, &val) && !val) {
+        lime_stat_add(excluded, PAGE_SIZE);
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+/* Whether a page just read repeats one already written; see dedup.c. */
+static inline int page_duplicate(const void * v, resource_size_t addr, resource_size_t * src) {
+#ifdef LIME_SUPPORTS_DEDUP
+    if (dedup > 0)
+        return dedup_find(v, addr, src);
+#endif
+    return 0;
+}
+
+static void write_range_sparse(struct resource * res) {
+    resource_size_t i, is, src, skip;
+    struct lime_budget b;
+    unsigned long val;
+    ssize_t s;
+    void * v;
+
+    DBG("Writing sparse range %llx - %llx.", (unsigned long long) res->start, (unsigned long long) res->end);
+
+    budget_start(&b, res->start);
+
+    for (i = res->start; i <= res->end; i += is) {
+        if (unlikely(lime_checkpoint()))
+            break;
+
+        is = min((resource_size_t) PAGE_SIZE, (resource_size_t) (res->end - i + 1));
+
+        if (unlikely(skip = lime_budget(&b, i))) {
+            is = min(skip, (resource_size_t) (res->end - i + 1));
+            skipmap_add(i, is, -1);
+            lime_stat_add(padded, is);
+            s = sparse_fill(i, is, 0);
+        } else if (is < PAGE_SIZE || unlikely(!lime_pfn_valid(i >> PAGE_SHIFT))) {
+            lime_stat_add(padded, is);
+            s = sparse_fill(i, is, 0);
+        } else if (unlikely(skip = lime_excluded(i, res->end - i + 1))) {
+            // Excluded pages get no record, like unchanged ones
+            is = skip;
+            s = sparse_flush();
+        } else {
+            v = (u8 *) run_buf + run_len;
+            read_page(v, i >> PAGE_SHIFT);
+
+            if (!page_changed(i >> PAGE_SHIFT))
+                s = sparse_flush();
+            else if (page_zero_excluded(v))
+                s = sparse_flush();
+            else if (sparse && page_filled(v, &val))
+                s = sparse_fill(i, PAGE_SIZE, val);
+            else if (page_duplicate(v, i, &src))
+                s = sparse_ref(i, src);
+            else
+                s = sparse_data(i);
+        }
+
+        if (s < 0) {
+            DBG("Failed to write page: addr 0x%llx. Skipping Range...", (unsigned long long) i);
+            break;
+        }
+    }
+
+    if (sparse_flush() < 0)
+        DBG("Failed to flush sparse range 0x%llx - 0x%llx", (unsigned long long) res->start, (unsigned long long) res->end);
+}
+
+/*
+ * lime2 output.  Each range starts with a version 2 header and is stored
+ * as LIME_CHUNK_SIZE blocks of physical memory, each one a separate gzip
+ * member when compressing.  The file ends with an index of every block
+ * (physical address, file offset, stored length) followed by a
+ * lime_index_trailer, so readers can seek straight to any block.  The
+ * digest covers the file exactly as written.
+ */
+static unsigned long count_blocks(void) {
+    struct resource * p;
+    unsigned long n = 0;
+
+    for (p = iomem_resource.child; p; ) {
+        if (!lime_is_ram(p)) {
+            p = lime_next_resource(p);
+            continue;
+        }
+        n += DIV_ROUND_UP(p->end - p->start + 1, LIME_CHUNK_SIZE);
+        p = lime_skip_subtree(p);
+    }
+
+    return n;
+}
+
+#ifdef LIME_SUPPORTS_STATS
+/* Bytes of System RAM to be read, for estimating progress. */
+static u64 ram_size(void) {
+    struct resource * p;
+    u64 n = 0;
+
+    for (p = iomem_resource.child; p; ) {
+        if (!lime_is_ram(p)) {
+            p = lime_next_resource(p);
+            continue;
+        }
+        n += p->end - p->start + 1;
+        p = lime_skip_subtree(p);
+    }
+
+    return n;
+}
+#endif
+
+#ifdef LIME_SUPPORTS_PREALLOC
+/*
+ * Expected size of the image, from the same walk as the dump.  It is
+ * exact for uncompressed output that leaves nothing out.  Sparse output
+ * is estimated when sample is set, by reading one page in
+ * LIME_PRESCAN_STRIDE and assuming filled pages are as common
+ * everywhere; otherwise, and with compression, the size is unknown and
+ * 0 is returned.
+ */
+/*
+ * page_filled() on a page in place, for prescan samples.  Unlike
+ * read_page() it leaves the stats and fingerprints alone.
+ */
+static int sample_filled(unsigned long pfn, unsigned long * val) {
+    struct page * p = pfn_to_page(pfn);
+    void * v;
+    int ret;
+
+    v = lime_map_page(p);
+    ret = page_filled(v, val);
+    lime_unmap_page(v, p);
+
+    return ret;
+}
+
+static u64 estimate_size(int sample, int * exact) {
+    struct resource * p;
+    resource_size_t next = 0;
+    unsigned long pfn, val, pages = 0, filled = 0;
+    u64 n = 0, ram = 0;
+
+    *exact = !sparse;
+
+#ifdef LIME_SUPPORTS_COMPRESS
+    if (compress)
+        return 0;
+#endif
+    if ((run_buf && !sparse) || (sparse && !sample))
+        return 0;
+
+    for (p = iomem_resource.child; p; ) {
+        if (!lime_is_ram(p)) {
+            p = lime_next_resource(p);
+            continue;
+        }
+
+        if (mode == LIME_MODE_PADDED)
+            n += p->start - next;
+        else if (mode != LIME_MODE_RAW)
+            n += sizeof(lime_mem_range_header);
+
+        n += p->end - p->start + 1;
+        ram += p->end - p->start + 1;
+        next = p->end + 1;
+
+        for (pfn = PFN_UP(p->start); sparse && pfn < PFN_DOWN(p->end + 1); pfn += LIME_PRESCAN_STRIDE) {
+            if (!pfn_valid(pfn) || PageHWPoison(pfn_to_page(pfn)))
+                continue;
+
+            pages++;
+            if (sample_filled(pfn, &val) && (mode == LIME_MODE_LIME || val == 0))
+                filled++;
+        }
+
+        p = lime_skip_subtree(p);
+    }
+
+    if (mode == LIME_MODE_LIME2)
+        n += count_blocks() * sizeof(lime_index_entry) + sizeof(lime_index_trailer);
+
+    // Filled pages become holes, or headers with no data in lime output
+    if (pages)
+        n -= (ram >> 10) * div_u64((u64) filled << 10, pages);
+
+    return n;
+}
+
+/* Size the output up front: fail now if it cannot fit, and reserve it when the size is exact. */
+static int prescan_output(void) {
+    int exact;
+    u64 n;
+
+    n = estimate_size(prescan > 1, &exact);
+    if (!n) {
+        DBG("Output size unknown, not preallocating");
+        return 0;
+    }
+
+    DBG("Expected output size %llu bytes%s", (unsigned long long) n, exact ? "" : " (estimated)");
+
+    return prealloc_disk(n, exact);
+}
+#endif
+
+#ifdef LIME_SUPPORTS_DELTA
+/* Size the fingerprint table to the System RAM ranges and load the baseline. */
+static int fp_start(void) {
+    struct resource * p;
+    int err;
+
+    for (p = iomem_resource.child; p; ) {
+        if (!lime_is_ram(p)) {
+            p = lime_next_resource(p);
+            continue;
+        }
+        if ((err = delta_add_range(p->start, p->end)) < 0) {
+            delta_stop();
+            return err;
+        }
+        p = lime_skip_subtree(p);
+    }
+
+    return delta_start(baseline);
+}
+#endif
+
+static ssize_t write_raw(void * v, ssize_t is) {
+    ssize_t ret;
+
+    budget_stall_begin();
+
+    if (compute_digest == LIME_DIGEST_COMPUTE)
+        update_digest(v, is);
+
+    ret = try_write(v, is);
+
+    budget_stall_end();
+
+    return ret;
+}
+
+/* Emit one stored block; blocks leave in the order they were indexed. */
+static ssize_t write_indexed(void * v, ssize_t is) {
+    lime_index_entry * e = &block_index[nemitted++];
+
+    e->offset = out_pos;
+    e->length = is;
+#ifdef LIME_SUPPORTS_COMPRESS
+    e->flags = block_flags[compress];
+#endif
+
+    return write_raw(v, is);
+}
+
+static ssize_t write_block(void * v, size_t is) {
+    ssize_t ret;
+
+    if (nindexed == nblocks) {
+        DBG("Block index full at 0x%llx", (unsigned long long) block_addr);
+        return -ENOSPC;
+    }
+
+    memset(&block_index[nindexed], 0, sizeof(lime_index_entry));
+    block_index[nindexed++].s_addr = block_addr;
+    block_addr += is;
+
+#ifdef LIME_SUPPORTS_COMPRESS_THREADS
+    if (compress) {
+        budget_stall_begin();
+        if ((ret = compress_write(v, is, write_indexed)) >= 0)
+            ret = compress_sync(write_indexed);
+        budget_stall_end();
+        return (ret < 0) ? ret : (ssize_t) is;
+    }
+#endif
+
+    ret = write_indexed(v, is);
+    return (ret < 0) ? ret : (ssize_t) is;
+}
+
+static ssize_t write_block_header(struct resource * res) {
+    lime_mem_range_header header;
+#ifdef LIME_SUPPORTS_COMPRESS_THREADS
+    ssize_t ret;
 
-        if (timeout > 0 && ktime_to_ms(ktime_sub(end, start)) > timeout) {
-            DBG("Reading is too slow.  Skipping Range...");
-            write_padding(res->end - i + 1 - is);
+    /* Blocks of the previous range must reach the file before the header. */
+    if (compress && (ret = compress_flush(write_indexed)) < 0)
+        return ret;
+#endif
+
+    memset(&header, 0, sizeof(lime_mem_range_header));
+    header.magic = LIME_MAGIC;
+    header.version = 2;
+    header.s_addr = res->start;
+    header.e_addr = res->end;
+
+    block_addr = res->start;
+
+    return write_raw(&header, sizeof(lime_mem_range_header));
+}
+
+/*
+ * Read len bytes of physical memory at addr into buf, zeroing partial
+ * pages, invalid PFNs, excluded pages and whatever the latency budget b
+ * skips.
+ */
+static void read_block(void * buf, resource_size_t addr, size_t len, struct lime_budget * b) {
+    resource_size_t skip;
+    unsigned long n;
+    size_t off, is;
+
+    for (off = 0; off < len; off += is) {
+        is = min(len - off, (size_t) PAGE_SIZE);
+
+        if (unlikely(skip = lime_budget(b, addr + off))) {
+            is = min_t(resource_size_t, skip, len - off);
+            memset((u8 *) buf + off, 0, is);
+            lime_stat_add(padded, is);
+            skipmap_add(addr + off, is, -1);
+        } else if ((n = direct_run(addr + off, addr + len - 1))) {
+            read_run((u8 *) buf + off, (addr + off) >> PAGE_SHIFT, n);
+            is = (size_t) n << PAGE_SHIFT;
+        } else if (is < PAGE_SIZE || unlikely(!lime_pfn_valid((addr + off) >> PAGE_SHIFT))) {
+            memset((u8 *) buf + off, 0, is);
+            lime_stat_add(padded, is);
+        } else if (unlikely(skip = lime_excluded(addr + off, len - off))) {
+            is = skip;
+            memset((u8 *) buf + off, 0, is);
+        } else
+            read_page((u8 *) buf + off, (addr + off) >> PAGE_SHIFT);
+    }
+}
+
+static void write_range_blocks(struct resource * res) {
+    resource_size_t i, len;
+    struct lime_budget b;
+
+    DBG("Writing blocks %llx - %llx.", (unsigned long long) res->start, (unsigned long long) res->end);
+
+#ifdef LIME_SUPPORTS_THREADS
+    if (threads > 0) {
+        parallel_range(res->start, res->end, write_block);
+        return;
+    }
+#endif
+
+    budget_start(&b, res->start);
+
+    for (i = res->start; i <= res->end; i += len) {
+        len = min((resource_size_t) LIME_CHUNK_SIZE, (resource_size_t) (res->end - i + 1));
+
+        if (unlikely(lime_checkpoint()))
             break;
+
+        read_block(block_buf, i, len, &b);
+
+        if (write_block(block_buf, len) < 0) {
+            DBG("Failed to write block: addr 0x%llx. Skipping Range...", (unsigned long long) i);
+            break;
+        }
+    }
+}
+
+static ssize_t write_block_index(void) {
+    lime_index_trailer trailer;
+    ssize_t ret;
+
+    memset(&trailer, 0, sizeof(lime_index_trailer));
+    trailer.magic = LIME_INDEX_MAGIC;
+    trailer.version = 2;
+    trailer.offset = out_pos;
+    trailer.count = nemitted;
+
+    DBG("Writing lime2 index of %lu blocks at 0x%llx", nemitted, trailer.offset);
+
+    if (nemitted && (ret = write_raw(block_index, nemitted * sizeof(lime_index_entry))) < 0)
+        return ret;
+
+    return write_raw(&trailer, sizeof(lime_index_trailer));
+}
+
+static ssize_t write_page(unsigned long pfn) {
+    void * v;
+    unsigned long val;
+
+#ifdef LIME_SUPPORTS_ZEROCOPY
+    if (zerocopy) {
+        struct page * p = pfn_to_page(pfn);
+
+        /*
+         * Free, slab and poisoned pages cannot be handed to the socket;
+         * they take the copy path below.
+         */
+        if (sendpage_ok(p) && !PageHWPoison(p)) {
+            ssize_t ret;
+
+            if ((ret = stage_flush()) < 0)
+                return ret;
+
+            zc_pages[zc_count++] = p;
+            if (zc_count == LIME_ZEROCOPY_BATCH && (ret = zerocopy_flush()) < 0)
+                return ret;
+
+            return PAGE_SIZE;
         }
+    }
 #endif
 
+    v = page_buffer();
+    read_page(v, pfn);
+
+    if (sparse && page_filled(v, &val) && val == 0)
+        return write_hole(PAGE_SIZE);
+
+    return write_buffered(v, PAGE_SIZE);
+}
+
+/*
+ * Check whether a page holds a single repeated word, as zeroed and
+ * poison-filled free pages do.  Data pages almost always differ in the
+ * first or last word, so those are compared before the scan.
+ */
+static int page_filled(const void * v, unsigned long * val) {
+    const unsigned long * w = v;
+    size_t i, last = PAGE_SIZE / sizeof(*w) - 1;
+
+    if (w[0] != w[last])
+        return 0;
+
+    for (i = 1; i < last; i++)
+        if (w[i] != w[0])
+            return 0;
+
+    *val = w[0];
+    return 1;
+}
+
+/*
+ * Skip zeros in raw and padded output.  They still go through the
+ * digest so it matches the file read back.
+ */
+static ssize_t write_hole(size_t is) {
+    size_t i, n;
+    ssize_t ret;
+
+    if ((ret = stage_flush()) < 0)
+        return ret;
+
+    budget_stall_begin();
+
+    for (i = 0; compute_digest == LIME_DIGEST_COMPUTE && i < is; i += n) {
+        n = min(is - i, (size_t) PAGE_SIZE);
+        update_digest(page_address(ZERO_PAGE(0)), n);
+    }
+
+    skip_disk(is);
+
+    budget_stall_end();
+
+    return is;
+}
+
+/* Copy a mapped page into dst, zeroing bytes lost to a memory error. */
+static void copy_page_checked(void * dst, const void * v, unsigned long pfn) {
+#ifdef copy_mc_to_kernel
+    unsigned long mc_err;
+
+    mc_err = copy_mc_to_kernel(dst, v, PAGE_SIZE);
+    if (mc_err) {
+        DBG("Hardware memory error at PFN 0x%llx (%lu bytes unreadable)",
+            (unsigned long long) pfn, mc_err);
+        lime_stat_add(copy_errors, 1);
+        memset((char *)dst + PAGE_SIZE - mc_err, 0, mc_err);
     }
+#else
+    copy_page(dst, (void *) v);
+#endif
+}
+
+#ifdef LIME_SUPPORTS_LOWCACHE_STORES
+/*
+ * Copy a page without leaving either copy in the cache: the source was
+ * prefetched non-temporally, and the destination is stored around the
+ * cache with memcpy_flushcache().  That has no machine check recovery,
+ * so the page goes through a per-CPU page first, which stays hot.
+ */
+static void copy_page_lowcache(void * dst, const void * v, unsigned long pfn) {
+    void * b = get_cpu_ptr(bounce);
+
+    copy_page_checked(b, v, pfn);
+    memcpy_flushcache(dst, b, PAGE_SIZE);
+    put_cpu_ptr(bounce);
+
+    // Order the non-temporal stores before the page is handed on
+    wmb();
+}
+#endif
+
+/*
+ * Copy one page of physical memory into dst.  The caller has already
+ * checked pfn_valid().  Bytes lost to a hardware memory error are zeroed.
+ */
+void read_page(void * dst, unsigned long pfn) {
+    struct page * p;
+    void * v;
+
+    p = pfn_to_page(pfn);
+    v = lime_map_page(p);
+#ifdef LIME_SUPPORTS_LOWCACHE
+    if (lowcache)
+        lime_prefetch_page(v);
+#endif
+#ifdef LIME_SUPPORTS_LOWCACHE_STORES
+    if (lowcache)
+        copy_page_lowcache(dst, v, pfn);
+    else
+#endif
+        copy_page_checked(dst, v, pfn);
+    lime_unmap_page(v, p);
+
+#ifdef LIME_SUPPORTS_DELTA
+    if (fingerprint)
+        delta_record(pfn, dst);
+#endif
+
+    lime_stat_add(read, PAGE_SIZE);
+
+    // Let other tasks run between pages on non-preemptible kernels
+    cond_resched();
+}
+
+#ifdef LIME_SUPPORTS_DIRECT_RUN
+/* Whether every PFN in a run is valid, checked once per (sub)section. */
+static int run_valid(unsigned long pfn, unsigned long n) {
+    unsigned long last = pfn + n - 1;
+
+#if defined(PAGES_PER_SUBSECTION)
+    for (; pfn < last; pfn = round_down(pfn, PAGES_PER_SUBSECTION) + PAGES_PER_SUBSECTION)
+        if (!pfn_valid(pfn))
+            return 0;
+#elif defined(CONFIG_SPARSEMEM)
+    for (; pfn < last; pfn = round_down(pfn, PAGES_PER_SECTION) + PAGES_PER_SECTION)
+        if (!pfn_valid(pfn))
+            return 0;
+#else
+    if (!pfn_valid(pfn))
+        return 0;
+#endif
+
+    return pfn_valid(last);
+}
+
+/*
+ * Number of whole pages from addr, up to end and the next chunk
+ * boundary, that read_run() can copy at once; 0 if addr should go
+ * through read_page().
+ */
+unsigned long direct_run(resource_size_t addr, resource_size_t end) {
+    resource_size_t limit;
+    unsigned long n;
+
+    if (!direct_runs || (addr & ~PAGE_MASK))
+        return 0;
+
+    limit = min(end + 1, round_down(addr, LIME_CHUNK_SIZE) + LIME_CHUNK_SIZE);
+    n = (limit - addr) >> PAGE_SHIFT;
+
+    if (n < 2 || !run_valid(addr >> PAGE_SHIFT, n))
+        return 0;
+
+    return n;
+}
+
+/*
+ * Copy n pages from pfn on, all valid, into dst with one copy out of the
+ * direct map.  As in read_page(), a page that hits a hardware memory
+ * error is zeroed from the bad byte on, and the copy resumes after it.
+ */
+void read_run(void * dst, unsigned long pfn, unsigned long n) {
+    const u8 * v = page_address(pfn_to_page(pfn));
+    size_t len = (size_t) n << PAGE_SHIFT;
+#ifdef copy_mc_to_kernel
+    size_t off = 0, bad, next;
+    unsigned long mc_err;
+
+    while (off < len && (mc_err = copy_mc_to_kernel((u8 *) dst + off, v + off, len - off))) {
+        bad = len - mc_err;
+        next = round_down(bad, PAGE_SIZE) + PAGE_SIZE;
+        DBG("Hardware memory error at PFN 0x%llx (%lu bytes unreadable)",
+            (unsigned long long) (pfn + (bad >> PAGE_SHIFT)), (unsigned long) (next - bad));
+        lime_stat_add(copy_errors, 1);
+        memset((u8 *) dst + bad, 0, next - bad);
+        off = next;
+    }
+#else
+    memcpy(dst, v, len);
+#endif
+
+#ifdef LIME_SUPPORTS_DELTA
+    if (fingerprint) {
+        unsigned long i;
+
+        for (i = 0; i < n; i++)
+            delta_record(pfn + i, (u8 *) dst + (i << PAGE_SHIFT));
+    }
+#endif
+
+    lime_stat_add(read, len);
+
+    cond_resched();
+}
+#endif
+
+static void update_digest(void * v, size_t is) {
+#ifdef LIME_SUPPORTS_THREADS
+    if (digest_async) {
+        compute_digest = ldigest_async_update(v, is);
+        // Only the staging buffers are left alone until stage_swap() waits
+        if (v != stage)
+            ldigest_async_wait(ldigest_async_mark());
+        return;
+    }
+#endif
+    compute_digest = ldigest_update(v, is);
 }
 
 static ssize_t write_vaddr(void * v, size_t is) {
     ssize_t ret;
 
     if (compute_digest == LIME_DIGEST_COMPUTE)
-        compute_digest = ldigest_update(v, is);
+        update_digest(v, is);
+
+#ifdef LIME_SUPPORTS_COMPRESS_THREADS
+    if (compress && compress_threads > 0)
+        return compress_write(v, is, try_write);
+#endif
 
 #ifdef LIME_SUPPORTS_DEFLATE
     if (compress) {
@@ -402,7 +1938,158 @@ static ssize_t write_vaddr(void * v, size_t is) {
     return try_write(v, is);
 }
 
+/* Output offset of the next byte, for padding that retry may rewrite. */
+static long long skip_offset(void) {
+#ifdef LIME_SUPPORTS_TIMING
+    if (retry)
+        return out_pos + stage_len;
+#endif
+    return -1;
+}
+
+/*
+ * Return where the next page should be copied.  When the staging buffer
+ * has room the page is read straight into it and write_buffered() will
+ * find it already in place; otherwise it goes through vpage.
+ */
+static void * page_buffer(void) {
+    if (stage && stage_size - stage_len >= PAGE_SIZE)
+        return (u8 *) stage + stage_len;
+    return vpage;
+}
+
+/*
+ * Move on to the spare staging buffer, leaving the one just written to
+ * the sink, and wait until the sink has let go of the spare.
+ */
+static int stage_swap(void) {
+#ifdef LIME_SUPPORTS_THREADS
+    if (digest_async)
+        stage_mark = ldigest_async_mark();
+    swap(stage_mark, spare_mark);
+#endif
+    swap(stage, stage_spare);
+#ifdef LIME_SUPPORTS_THREADS
+    if (digest_async)
+        ldigest_async_wait(stage_mark);
+#endif
+#ifdef LIME_SUPPORTS_BLK
+    if (method == LIME_METHOD_BLK)
+        return release_stage_blk(stage);
+#endif
+    return 0;
+}
+
+static ssize_t stage_flush(void) {
+    ssize_t ret = 0;
+    int err;
+
+    if (stage_len) {
+        budget_stall_begin();
+        ret = write_vaddr(stage, stage_len);
+        if (stage_spare && (err = stage_swap()) < 0 && ret >= 0)
+            ret = err;
+        budget_stall_end();
+        stage_len = 0;
+    }
+
+    return ret;
+}
+
+/*
+ * Accumulate output in the staging buffer so the digest, compressor and
+ * sink see a few large writes instead of one call per page.  Writes
+ * larger than the buffer skip it once it is empty.
+ */
+static ssize_t write_buffered(void * v, size_t is) {
+    size_t n, done = 0;
+    ssize_t ret;
+
+#ifdef LIME_SUPPORTS_ZEROCOPY
+    if (zc_count && (ret = zerocopy_flush()) < 0)
+        return ret;
+#endif
+
+    if (!stage) {
+        budget_stall_begin();
+        ret = write_vaddr(v, is);
+        budget_stall_end();
+        return ret;
+    }
+
+    while (done < is) {
+        // A run read into the whole buffer is flushed like any other fill
+        if (stage_len == 0 && is - done >= stage_size && (u8 *) v + done != (u8 *) stage) {
+            budget_stall_begin();
+            ret = write_vaddr((u8 *) v + done, is - done);
+            budget_stall_end();
+            return (ret < 0) ? ret : (ssize_t) is;
+        }
+
+        n = min(is - done, stage_size - stage_len);
+        if ((u8 *) v + done != (u8 *) stage + stage_len)
+            memcpy((u8 *) stage + stage_len, (u8 *) v + done, n);
+
+        stage_len += n;
+        done += n;
+
+        if (stage_len == stage_size && (ret = stage_flush()) < 0)
+            return ret;
+    }
+
+    return is;
+}
+
+/* Account for is bytes that reached the sink: position, stats and throttle. */
+static void account_write(ssize_t is) {
+    out_pos += is;
+    lime_stat_add(written, is);
+#ifdef LIME_SUPPORTS_STATS
+    stats_tick();
+#endif
+    throttle_write(is);
+}
+
+#ifdef LIME_SUPPORTS_ZEROCOPY
+static ssize_t zerocopy_flush(void) {
+    ssize_t ret;
+    ssize_t len = (ssize_t) zc_count * PAGE_SIZE;
+
+    // The socket reads these pages, so the send counts against the budget
+    ret = write_pages_tcp(zc_pages, zc_count);
+    zc_count = 0;
+
+    if (ret < 0) {
+        DBG("Zero-copy write error: %zd", ret);
+    } else if (ret != len) {
+        DBG("Short zero-copy write %zd instead of %zd.", ret, len);
+        ret = -1;
+    } else {
+        // These pages never pass through read_page()
+        lime_stat_add(read, ret);
+        account_write(ret);
+    }
+
+    return ret;
+}
+#endif
+
 static ssize_t write_flush(void) {
+    ssize_t ret;
+
+#ifdef LIME_SUPPORTS_ZEROCOPY
+    if (zc_count && (ret = zerocopy_flush()) < 0)
+        return ret;
+#endif
+
+    if ((ret = stage_flush()) < 0)
+        return ret;
+
+#ifdef LIME_SUPPORTS_COMPRESS_THREADS
+    if (compress && compress_threads > 0)
+        return compress_flush((mode == LIME_MODE_LIME2) ? write_indexed : try_write);
+#endif
+
 #ifdef LIME_SUPPORTS_DEFLATE
     if (compress) {
         try_write(deflate_page_buf, deflate(NULL, 0));
@@ -417,33 +2104,55 @@ static ssize_t try_write(void * v, ssize_t is) {
     if (is <= 0)
         return is;
 
-    ret = RETRY_IF_INTERRUPTED(
-        (method == LIME_METHOD_TCP) ? write_vaddr_tcp(v, is) : write_vaddr_disk(v, is)
-    );
+    ret = RETRY_IF_INTERRUPTED(write_sink(v, is));
 
     if (ret < 0) {
         DBG("Write error: %zd", ret);
     } else if (ret != is) {
         DBG("Short write %zd instead of %zd.", ret, is);
         ret = -1;
+    } else {
+        account_write(ret);
     }
 
     return ret;
 }
 
+static ssize_t write_sink(void * v, size_t is) {
+#ifdef LIME_SUPPORTS_BLK
+    if (method == LIME_METHOD_BLK)
+        return (v == stage && stage_spare) ? write_stage_blk(v, is) : write_vaddr_blk(v, is);
+#endif
+    return LIME_METHOD_IS_SOCKET(method) ? write_vaddr_tcp(v, is) : write_vaddr_disk(v, is);
+}
+
 static int setup(void) {
-    return (method == LIME_METHOD_TCP) ? setup_tcp() : setup_disk(path, dio);
+#ifdef LIME_SUPPORTS_BLK
+    if (method == LIME_METHOD_BLK)
+        return setup_blk(path + 4);
+#endif
+#ifdef LIME_SUPPORTS_THREADS
+    if (LIME_METHOD_IS_SOCKET(method))
+        return setup_tcp(streams);
+#endif
+    return LIME_METHOD_IS_SOCKET(method) ? setup_tcp(1) : setup_disk(path, dio);
 }
 
-static void cleanup(void) {
-    if (method == LIME_METHOD_TCP)
-        cleanup_tcp();
-    else
-        cleanup_disk();
+static int cleanup(void) {
+#ifdef LIME_SUPPORTS_BLK
+    if (method == LIME_METHOD_BLK)
+        return cleanup_blk();
+#endif
+    return LIME_METHOD_IS_SOCKET(method) ? cleanup_tcp() : cleanup_disk();
 }
 
 static void __exit lime_cleanup_module(void) {
-
+#ifdef LIME_SUPPORTS_CONTROL
+    control_stop();
+#endif
+#ifdef LIME_SUPPORTS_STATS
+    stats_stop();
+#endif
 }
 
 module_init(lime_init_module);
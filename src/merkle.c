@@ -0,0 +1,330 @@
+/*
+ * LiME - Linux Memory Extractor
+ * Copyright (c) 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ *
+ * Author:
+ * Joe T. Sylve, Ph.D.       - joe.sylve@gmail.com, @jtsylve
+ *
+ * SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "lime.h"
+
+#ifdef LIME_SUPPORTS_MERKLE
+
+/*
+ * Chunked Merkle digest.
+ *
+ * The digest stream is cut into LIME_CHUNK_SIZE chunks that are hashed
+ * independently on an unbound workqueue.  As in RFC 6962, each leaf is
+ * H(0x00 || chunk) and each parent H(0x01 || left || right), so a parent
+ * can never pass for the leaf of a chunk that happens to hold two hashes;
+ * an odd node at the end of a level is carried up unchanged.  The root
+ * goes in the usual sidecar and the leaves in a manifest next to it.
+ */
+
+#define MERKLE_LEAF 0x00
+#define MERKLE_NODE 0x01
+
+struct lime_mchunk {
+    struct work_struct work;
+    void *buf;
+    size_t len;
+    unsigned long seq;
+    int busy;
+    int err;
+    u8 hash[HASH_MAX_DIGESTSIZE];
+};
+
+static struct crypto_shash *tfm;
+static struct workqueue_struct *mwq;
+static struct lime_mchunk *mchunks;
+static int nmchunks;
+static int dsize;
+
+/* Leaf hashes, indexed by chunk sequence number. */
+static u8 *leaves;
+static unsigned long nleaves;
+static unsigned long capacity;
+
+static unsigned long next_seq;
+static int failed;
+
+static char *manifest;
+static size_t manifest_len;
+static size_t manifest_size;
+
+/* Hash len bytes at data behind a one-byte domain prefix. */
+static int merkle_hash(u8 prefix, const void *data, size_t len, u8 *out) {
+    SHASH_DESC_ON_STACK(desc, tfm);
+    int ret;
+
+    desc->tfm = tfm;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,2,0)
+    desc->flags = 0;
+#endif
+
+    ret = crypto_shash_init(desc);
+    if (!ret)
+        ret = crypto_shash_update(desc, &prefix, 1);
+    if (!ret)
+        ret = crypto_shash_update(desc, data, len);
+    if (!ret)
+        ret = crypto_shash_final(desc, out);
+
+    return ret;
+}
+
+static void merkle_work(struct work_struct *work) {
+    struct lime_mchunk *c = container_of(work, struct lime_mchunk, work);
+
+    c->err = merkle_hash(MERKLE_LEAF, c->buf, c->len, c->hash);
+}
+
+/* Wait for a submitted chunk and move its hash into the leaf array. */
+static int merkle_store(struct lime_mchunk *c) {
+    u8 *grown;
+
+    flush_work(&c->work);
+    c->busy = 0;
+    c->len = 0;
+
+    if (c->err) {
+        DBG("Chunk digest failed: %d", c->err);
+        return -EIO;
+    }
+
+    while (c->seq >= capacity) {
+        grown = vmalloc(capacity * 2 * dsize);
+        if (!grown)
+            return -ENOMEM;
+        memcpy(grown, leaves, nleaves * dsize);
+        vfree(leaves);
+        leaves = grown;
+        capacity *= 2;
+    }
+
+    memcpy(leaves + c->seq * dsize, c->hash, dsize);
+    nleaves = max(nleaves, c->seq + 1);
+
+    return 0;
+}
+
+static void merkle_submit(struct lime_mchunk *c) {
+    c->seq = next_seq++;
+    c->busy = 1;
+    queue_work(mwq, &c->work);
+}
+
+int merkle_init(int n) {
+    int i;
+
+    tfm = crypto_alloc_shash(digest, 0, 0);
+    if (IS_ERR(tfm)) {
+        tfm = NULL;
+        goto fail;
+    }
+    dsize = crypto_shash_digestsize(tfm);
+
+    DBG("Starting %d chunk digest workers.", n);
+
+    nmchunks = n * 2;
+    mwq = alloc_workqueue("lime_merkle", WQ_UNBOUND, n);
+    mchunks = kcalloc(nmchunks, sizeof(*mchunks), GFP_KERNEL);
+    if (!mwq || !mchunks)
+        goto fail;
+
+    for (i = 0; i < nmchunks; i++) {
+        mchunks[i].buf = vmalloc(LIME_CHUNK_SIZE);
+        if (!mchunks[i].buf)
+            goto fail;
+        INIT_WORK(&mchunks[i].work, merkle_work);
+    }
+
+    /* One leaf per MB of RAM covers most dumps; the array grows if not. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
+    capacity = (totalram_pages() >> (20 - PAGE_SHIFT)) + 64;
+#else
+    capacity = (totalram_pages >> (20 - PAGE_SHIFT)) + 64;
+#endif
+    leaves = vmalloc(capacity * dsize);
+    if (!leaves)
+        goto fail;
+
+    nleaves = next_seq = 0;
+    failed = 0;
+
+    return dsize;
+
+fail:
+    DBG("Failed to start chunk digest workers");
+    merkle_clean();
+    return -ENOMEM;
+}
+
+int merkle_update(void *v, size_t is) {
+    struct lime_mchunk *c;
+    size_t n;
+
+    while (is > 0 && !failed) {
+        c = &mchunks[next_seq % nmchunks];
+
+        if (c->busy && merkle_store(c) < 0) {
+            failed = 1;
+            break;
+        }
+
+        n = min(is, LIME_CHUNK_SIZE - c->len);
+        memcpy((u8 *) c->buf + c->len, v, n);
+        c->len += n;
+        v = (u8 *) v + n;
+        is -= n;
+
+        if (c->len == LIME_CHUNK_SIZE)
+            merkle_submit(c);
+    }
+
+    return failed ? LIME_DIGEST_FAILED : LIME_DIGEST_COMPUTE;
+}
+
+static int merkle_manifest(void) {
+    unsigned long i;
+
+    manifest_size = 128 + (nleaves + 1) * (dsize * 2 + 24);
+    manifest = vmalloc(manifest_size);
+    if (!manifest)
+        return -ENOMEM;
+
+    manifest_len = scnprintf(manifest, manifest_size, "algorithm %s\nchunk_size %lu\nchunks %lu\n",
+                             digest, LIME_CHUNK_SIZE, nleaves);
+
+    for (i = 0; i < nleaves; i++)
+        manifest_len += scnprintf(manifest + manifest_len, manifest_size - manifest_len,
+                                  "%lu %*phN\n", i, dsize, leaves + i * dsize);
+
+    return 0;
+}
+
+/* Finish hashing, build the manifest and reduce the leaves to the root. */
+int merkle_final(u8 *root) {
+    struct lime_mchunk *c = &mchunks[next_seq % nmchunks];
+    unsigned long i, n;
+    int ret;
+
+    // An empty stream still has one (empty) leaf
+    if (!failed && (c->len > 0 || next_seq == 0))
+        merkle_submit(c);
+
+    for (i = 0; i < nmchunks; i++)
+        if (mchunks[i].busy && merkle_store(&mchunks[i]) < 0)
+            failed = 1;
+
+    if (failed)
+        return -EIO;
+
+    if ((ret = merkle_manifest()) < 0)
+        return ret;
+
+    for (n = nleaves; n > 1; n = (n + 1) / 2) {
+        for (i = 0; i < n / 2; i++) {
+            ret = merkle_hash(MERKLE_NODE, leaves + 2 * i * dsize, 2 * dsize, leaves + i * dsize);
+            if (ret)
+                return ret;
+        }
+        if (n & 1)
+            memmove(leaves + (n / 2) * dsize, leaves + (n - 1) * dsize, dsize);
+    }
+
+    memcpy(root, leaves, dsize);
+
+    manifest_len += scnprintf(manifest + manifest_len, manifest_size - manifest_len, "root %*phN\n", dsize, root);
+
+    return 0;
+}
+
+int merkle_write_tcp(void) {
+    int ret;
+
+    ret = setup_tcp(1);
+    if (ret < 0) {
+        DBG("Socket bind failed for digest manifest: %d", ret);
+        cleanup_tcp();
+        return LIME_DIGEST_FAILED;
+    }
+
+    RETRY_IF_INTERRUPTED(write_vaddr_tcp(manifest, manifest_len));
+
+    cleanup_tcp();
+
+    return 0;
+}
+
+int merkle_write_disk(void) {
+    char *p;
+    int ret = 0;
+    int len;
+
+    len = strlen(path) + strlen(digest) + sizeof(".manifest") + 1;
+    p = kmalloc(len, GFP_KERNEL);
+    if (!p)
+        return LIME_DIGEST_FAILED;
+
+    snprintf(p, len, "%s.%s.manifest", path, digest);
+
+    if (setup_disk(p, 0)) {
+        ret = LIME_DIGEST_FAILED;
+        goto out;
+    }
+
+    RETRY_IF_INTERRUPTED(write_vaddr_disk(manifest, manifest_len));
+
+out:
+    cleanup_disk();
+    kfree(p);
+
+    return ret;
+}
+
+void merkle_clean(void) {
+    int i;
+
+    // Destroying the workqueue waits for any chunk still being hashed
+    if (mwq) {
+        destroy_workqueue(mwq);
+        mwq = NULL;
+    }
+
+    if (mchunks) {
+        for (i = 0; i < nmchunks; i++)
+            vfree(mchunks[i].buf);
+        kfree(mchunks);
+        mchunks = NULL;
+    }
+
+    vfree(leaves);
+    leaves = NULL;
+    vfree(manifest);
+    manifest = NULL;
+
+    if (tfm) {
+        crypto_free_shash(tfm);
+        tfm = NULL;
+    }
+}
+
+#endif
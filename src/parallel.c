@@ -0,0 +1,390 @@
+/*
+ * LiME - Linux Memory Extractor
+ * Copyright (c) 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ *
+ * Author:
+ * Joe T. Sylve, Ph.D.       - joe.sylve@gmail.com, @jtsylve
+ *
+ * SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "lime.h"
+
+#ifdef LIME_SUPPORTS_THREADS
+
+/*
+ * Parallel acquisition.
+ *
+ * A range is split into LIME_CHUNK_SIZE chunks numbered by a global,
+ * monotonically increasing sequence.  Reader kthreads (one per CPU)
+ * claim the next sequence number, copy that chunk into the ring slot
+ * seq % nslots and mark it ready.  The calling thread is the only
+ * writer: it consumes slots strictly in sequence order, so the output
+ * is byte-for-byte what the single-threaded loop in main.c produces.
+ *
+ * Each reader copies into one of its own two buffers, allocated on its
+ * node, and hands it over through the slot.  A reader may only fill a
+ * slot once the writer has consumed the chunk that previously occupied
+ * it, and a buffer once the chunk it held has been written, which
+ * bounds memory use regardless of the range size.
+ *
+ * With numa=1 readers are spread over the nodes and a chunk is only
+ * claimed by a reader on the node its memory is on, so copies do not
+ * cross the interconnect.  Chunks on a node without a reader, or whose
+ * first page is not valid, go to any reader, and so does a chunk whose
+ * node has no reader waiting for work: an idle reader copying across
+ * the interconnect is faster than one waiting for a busy node.
+ */
+
+struct lime_slot {
+    void *buf;
+    size_t len;
+    unsigned long ready;    /* sequence number of the chunk in buf */
+};
+
+struct lime_reader {
+    struct task_struct *task;
+    int node;
+    int cur;
+    void *buf[2];
+    unsigned long busy[2];  /* buffer is free once consumed reaches this */
+    struct lime_duty duty;
+};
+
+static struct lime_reader *readers;
+static int nreaders;
+
+static int numa;
+static nodemask_t reader_nodes;
+
+/* Readers per node waiting to claim a chunk, with numa=1. */
+static atomic_t *node_idle;
+
+static struct lime_slot *slots;
+static int nslots;
+
+static DEFINE_SPINLOCK(job_lock);
+static DECLARE_WAIT_QUEUE_HEAD(job_wait);
+static DECLARE_WAIT_QUEUE_HEAD(ready_wait);
+static DECLARE_WAIT_QUEUE_HEAD(free_wait);
+
+/* Current job, protected by job_lock. */
+static resource_size_t job_start;
+static resource_size_t job_end;
+static unsigned long job_first;
+static unsigned long job_last;
+static unsigned long next_seq;
+
+/* Node of the chunk next_seq, or NUMA_NO_NODE if any reader may take it. */
+static int next_node;
+
+/* Next sequence number the writer will consume. */
+static unsigned long consumed;
+
+#ifdef LIME_SUPPORTS_TIMING
+/* Lowest sequence number after which the current job is padding, set on cancel. */
+static unsigned long abort_seq;
+#endif
+
+static void fill_chunk(struct lime_slot *slot, resource_size_t addr, unsigned long seq) {
+    resource_size_t i, end, skip;
+    struct lime_budget b;
+    unsigned long n;
+    size_t is;
+    u8 *dst;
+
+    end = addr + slot->len - 1;
+
+    // Each chunk has its own budget; a slow one only pads itself
+    budget_start(&b, addr);
+    b.reader = 1;
+
+    for (i = addr; i <= end; i += is) {
+        dst = (u8 *) slot->buf + (i - addr);
+        is = min((resource_size_t) PAGE_SIZE, (resource_size_t) (end - i + 1));
+
+#ifdef LIME_SUPPORTS_TIMING
+        /* The dump was cancelled; the rest of the range is padding. */
+        if (seq > READ_ONCE(abort_seq)) {
+            memset(dst, 0, end - i + 1);
+            lime_stat_add(padded, end - i + 1);
+            break;
+        }
+#endif
+
+        if (unlikely(skip = lime_budget(&b, i))) {
+            is = min(skip, (resource_size_t) (end - i + 1));
+            memset(dst, 0, is);
+            lime_stat_add(padded, is);
+            skipmap_add(i, is, -1);
+        } else if ((n = direct_run(i, end))) {
+            read_run(dst, i >> PAGE_SHIFT, n);
+            is = (size_t) n << PAGE_SHIFT;
+        } else if (is < PAGE_SIZE || unlikely(!lime_pfn_valid(i >> PAGE_SHIFT))) {
+            memset(dst, 0, is);
+            lime_stat_add(padded, is);
+        } else if (unlikely(skip = lime_excluded(i, end - i + 1))) {
+            is = skip;
+            memset(dst, 0, is);
+        } else
+            read_page(dst, i >> PAGE_SHIFT);
+    }
+}
+
+/* Node whose readers copy chunk seq of the current job; job_lock is held. */
+static int chunk_node(unsigned long seq) {
+    unsigned long pfn;
+    int node;
+
+    if (!numa || seq >= job_last)
+        return NUMA_NO_NODE;
+
+    pfn = PFN_DOWN(job_start + (resource_size_t) (seq - job_first) * LIME_CHUNK_SIZE);
+    if (!pfn_valid(pfn))
+        return NUMA_NO_NODE;
+
+    node = page_to_nid(pfn_to_page(pfn));
+
+    return node_isset(node, reader_nodes) ? node : NUMA_NO_NODE;
+}
+
+static int may_claim(struct lime_reader *r) {
+    int node = READ_ONCE(next_node);
+
+    if (READ_ONCE(next_seq) >= READ_ONCE(job_last))
+        return 0;
+
+    return node == NUMA_NO_NODE || node == r->node || !atomic_read(&node_idle[node]);
+}
+
+static int reader_thread(void *arg) {
+    struct lime_reader *r = arg;
+    struct lime_slot *slot;
+    resource_size_t addr;
+    unsigned long seq;
+    int node, wake;
+
+    throttle_begin(&r->duty);
+
+    while (!kthread_should_stop()) {
+        if (numa)
+            atomic_inc(&node_idle[r->node]);
+        wait_event_interruptible(job_wait, kthread_should_stop() || may_claim(r));
+        if (numa)
+            atomic_dec(&node_idle[r->node]);
+
+        spin_lock(&job_lock);
+        if (!may_claim(r)) {
+            spin_unlock(&job_lock);
+            continue;
+        }
+        seq = next_seq++;
+        addr = job_start + (resource_size_t) (seq - job_first) * LIME_CHUNK_SIZE;
+        node = next_node;
+        next_node = chunk_node(next_seq);
+        wake = next_node != node ||
+               (next_node != NUMA_NO_NODE && !atomic_read(&node_idle[next_node]));
+        spin_unlock(&job_lock);
+
+        /* Readers of another node may take the next chunk now. */
+        if (wake)
+            wake_up_all(&job_wait);
+
+        /* Wait for the writer to release the chunk nslots behind us and our buffer. */
+        wait_event_interruptible(free_wait, seq < READ_ONCE(consumed) + nslots &&
+                                            r->busy[r->cur] <= READ_ONCE(consumed));
+
+        slot = &slots[seq % nslots];
+        slot->buf = r->buf[r->cur];
+        slot->len = min((resource_size_t) LIME_CHUNK_SIZE, (resource_size_t) (job_end - addr + 1));
+        fill_chunk(slot, addr, seq);
+
+        r->busy[r->cur] = seq + 1;
+        r->cur ^= 1;
+
+        smp_store_release(&slot->ready, seq);
+        wake_up(&ready_wait);
+
+        throttle_cpu(&r->duty);
+    }
+
+    return 0;
+}
+
+static int start_reader(struct lime_reader *r, int cpu) {
+    r->node = cpu_to_node(cpu);
+    r->buf[0] = vmalloc_node(LIME_CHUNK_SIZE, r->node);
+    r->buf[1] = vmalloc_node(LIME_CHUNK_SIZE, r->node);
+    if (!r->buf[0] || !r->buf[1])
+        return -ENOMEM;
+
+    r->task = kthread_create_on_node(reader_thread, r, r->node, "lime/%d", cpu);
+    if (IS_ERR(r->task)) {
+        r->task = NULL;
+        return -ENOMEM;
+    }
+
+    node_set(r->node, reader_nodes);
+    kthread_bind(r->task, cpu);
+    wake_up_process(r->task);
+
+    return 0;
+}
+
+/* The n-th online CPU of a node, or nr_cpu_ids if it has fewer. */
+static int node_cpu(int node, int n) {
+    int cpu;
+
+    for_each_cpu(cpu, cpumask_of_node(node))
+        if (cpu_online(cpu) && n-- == 0)
+            return cpu;
+
+    return nr_cpu_ids;
+}
+
+int parallel_start(int n, int use_numa) {
+    int i, cpu, node, round;
+
+    nreaders = min(n, (int) num_online_cpus());
+    nslots = nreaders * 2;
+    numa = use_numa;
+    nodes_clear(reader_nodes);
+
+    DBG("Starting %d reader threads.", nreaders);
+
+    slots = kcalloc(nslots, sizeof(*slots), GFP_KERNEL);
+    readers = kcalloc(nreaders, sizeof(*readers), GFP_KERNEL);
+    if (!slots || !readers)
+        goto fail;
+
+    if (numa) {
+        node_idle = kcalloc(nr_node_ids, sizeof(*node_idle), GFP_KERNEL);
+        if (!node_idle)
+            goto fail;
+    }
+
+    for (i = 0; i < nslots; i++)
+        slots[i].ready = ULONG_MAX;
+
+    next_seq = job_first = job_last = consumed = 0;
+    next_node = NUMA_NO_NODE;
+
+    i = 0;
+    if (numa) {
+        // Deal CPUs out one node at a time so every node gets a reader
+        for (round = 0; i < nreaders && round < nr_cpu_ids; round++) {
+            for_each_online_node(node) {
+                if (i == nreaders || (cpu = node_cpu(node, round)) >= nr_cpu_ids)
+                    continue;
+                if (start_reader(&readers[i++], cpu) < 0)
+                    goto fail;
+            }
+        }
+
+        DBG("Readers on %d NUMA nodes", nodes_weight(reader_nodes));
+    } else {
+        for_each_online_cpu(cpu) {
+            if (i == nreaders)
+                break;
+            if (start_reader(&readers[i++], cpu) < 0)
+                goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    DBG("Failed to start reader threads");
+    parallel_stop();
+    return -ENOMEM;
+}
+
+void parallel_stop(void) {
+    int i;
+
+    if (readers) {
+        for (i = 0; i < nreaders; i++) {
+            if (readers[i].task)
+                kthread_stop(readers[i].task);
+            vfree(readers[i].buf[0]);
+            vfree(readers[i].buf[1]);
+        }
+        kfree(readers);
+        readers = NULL;
+    }
+
+    kfree(slots);
+    slots = NULL;
+    kfree(node_idle);
+    node_idle = NULL;
+}
+
+void parallel_range(resource_size_t start, resource_size_t end, ssize_t (*write)(void *, size_t)) {
+    struct lime_slot *slot;
+    unsigned long seq, first, last;
+    int failed = 0;
+
+    spin_lock(&job_lock);
+    job_start = start;
+    job_end = end;
+    first = job_first = next_seq;
+    last = job_last = first + DIV_ROUND_UP(end - start + 1, LIME_CHUNK_SIZE);
+#ifdef LIME_SUPPORTS_TIMING
+    abort_seq = ULONG_MAX;
+#endif
+    next_node = chunk_node(first);
+    spin_unlock(&job_lock);
+
+    wake_up_all(&job_wait);
+
+    for (seq = first; seq < last; seq++) {
+        slot = &slots[seq % nslots];
+
+        wait_event(ready_wait, smp_load_acquire(&slot->ready) == seq);
+
+#ifdef LIME_SUPPORTS_TIMING
+        /* A reader may have finished this chunk before the dump was cancelled. */
+        if (seq > READ_ONCE(abort_seq))
+            memset(slot->buf, 0, slot->len);
+#endif
+
+        /* Once cancelled the rest of the job is read as padding and dropped. */
+        if (!failed && lime_checkpoint()) {
+            DBG("Dump cancelled");
+            failed = 1;
+#ifdef LIME_SUPPORTS_TIMING
+            spin_lock(&job_lock);
+            if (seq < abort_seq)
+                abort_seq = seq;
+            spin_unlock(&job_lock);
+#endif
+        }
+
+        /* On error keep draining so the readers finish the job. */
+        if (!failed && write(slot->buf, slot->len) < 0) {
+            DBG("Failed to write chunk: addr 0x%llx. Skipping Range...",
+                (unsigned long long) (start + (resource_size_t) (seq - first) * LIME_CHUNK_SIZE));
+            failed = 1;
+        }
+
+        smp_store_release(&consumed, seq + 1);
+        wake_up_all(&free_wait);
+    }
+}
+
+#endif
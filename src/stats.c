@@ -0,0 +1,190 @@
+/*
+ * LiME - Linux Memory Extractor
+ * Copyright (c) 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ *
+ * Author:
+ * Joe T. Sylve, Ph.D.       - joe.sylve@gmail.com, @jtsylve
+ *
+ * SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "lime.h"
+
+#ifdef LIME_SUPPORTS_STATS
+
+/*
+ * Acquisition progress in /sys/module/lime/stats.
+ *
+ * Counters are per-CPU so reader threads and the writer bump them with
+ * a single this_cpu_add() and never share a cache line; a sysfs read
+ * sums them.  The rate is refreshed by the writer at most once a second.
+ * The directory stays until the module is unloaded, so the final
+ * figures can be read after the dump completes.
+ */
+
+DEFINE_PER_CPU(struct lime_stats, lime_stats);
+
+static struct kobject *stats_kobj;
+
+static u64 total;
+static resource_size_t range_start;
+static resource_size_t range_end;
+
+static unsigned long rate_jiffies;
+static u64 rate_bytes;
+static u64 rate;
+
+/* When the first range was read and when the output was finished. */
+static unsigned long dump_start;
+static unsigned long dump_end;
+static int dump_started;
+static int dump_ended;
+
+static u64 stats_sum(size_t off) {
+    u64 n = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        n += *(u64 *) ((u8 *) per_cpu_ptr(&lime_stats, cpu) + off);
+
+    return n;
+}
+
+#define LIME_STAT_ATTR(name, field) \
+static ssize_t name##_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) { \
+    return sprintf(buf, "%llu\n", (unsigned long long) stats_sum(offsetof(struct lime_stats, field))); \
+} \
+static struct kobj_attribute name##_attr = __ATTR_RO(name)
+
+LIME_STAT_ATTR(bytes_read, read);
+LIME_STAT_ATTR(bytes_written, written);
+LIME_STAT_ATTR(bytes_padded, padded);
+LIME_STAT_ATTR(bytes_excluded, excluded);
+LIME_STAT_ATTR(invalid_pfns, invalid);
+LIME_STAT_ATTR(copy_errors, copy_errors);
+
+static ssize_t bytes_total_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    return sprintf(buf, "%llu\n", (unsigned long long) total);
+}
+static struct kobj_attribute bytes_total_attr = __ATTR_RO(bytes_total);
+
+static ssize_t range_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    return sprintf(buf, "0x%llx-0x%llx\n", (unsigned long long) READ_ONCE(range_start),
+                   (unsigned long long) READ_ONCE(range_end));
+}
+static struct kobj_attribute range_attr = __ATTR_RO(range);
+
+static ssize_t mb_per_sec_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    return sprintf(buf, "%llu\n", (unsigned long long) READ_ONCE(rate));
+}
+static struct kobj_attribute mb_per_sec_attr = __ATTR_RO(mb_per_sec);
+
+static ssize_t dump_ms_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    unsigned long end = READ_ONCE(dump_ended) ? READ_ONCE(dump_end) : jiffies;
+
+    if (!READ_ONCE(dump_started))
+        return sprintf(buf, "0\n");
+
+    return sprintf(buf, "%u\n", jiffies_to_msecs(end - READ_ONCE(dump_start)));
+}
+static struct kobj_attribute dump_ms_attr = __ATTR_RO(dump_ms);
+
+static struct attribute *stats_attrs[] = {
+    &bytes_total_attr.attr,
+    &bytes_read_attr.attr,
+    &bytes_written_attr.attr,
+    &bytes_padded_attr.attr,
+    &bytes_excluded_attr.attr,
+    &invalid_pfns_attr.attr,
+    &copy_errors_attr.attr,
+    &range_attr.attr,
+    &mb_per_sec_attr.attr,
+    &dump_ms_attr.attr,
+    NULL,
+};
+
+static struct attribute_group stats_group = {
+    .attrs = stats_attrs,
+};
+
+int stats_start(u64 bytes) {
+    int cpu, err;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(&lime_stats, cpu), 0, sizeof(struct lime_stats));
+
+    total = bytes;
+    range_start = range_end = 0;
+    rate_jiffies = jiffies;
+    rate_bytes = rate = 0;
+    dump_started = dump_ended = 0;
+
+    stats_kobj = kobject_create_and_add("stats", &THIS_MODULE->mkobj.kobj);
+    if (!stats_kobj)
+        return -ENOMEM;
+
+    err = sysfs_create_group(stats_kobj, &stats_group);
+    if (err) {
+        DBG("Failed to create stats in sysfs: %d", err);
+        stats_stop();
+    }
+
+    return err;
+}
+
+void stats_stop(void) {
+    if (stats_kobj) {
+        kobject_put(stats_kobj);
+        stats_kobj = NULL;
+    }
+}
+
+void stats_range(resource_size_t start, resource_size_t end) {
+    if (!dump_started) {
+        WRITE_ONCE(dump_start, jiffies);
+        WRITE_ONCE(dump_started, 1);
+    }
+
+    WRITE_ONCE(range_start, start);
+    WRITE_ONCE(range_end, end);
+}
+
+/* Stop the dump_ms clock once the output is finished. */
+void stats_done(void) {
+    if (dump_started && !dump_ended) {
+        WRITE_ONCE(dump_end, jiffies);
+        WRITE_ONCE(dump_ended, 1);
+    }
+}
+
+/* Refresh the rolling rate; cheap unless a second has passed. */
+void stats_tick(void) {
+    unsigned long now = jiffies;
+    u64 read;
+
+    if (time_before(now, rate_jiffies + HZ))
+        return;
+
+    read = stats_sum(offsetof(struct lime_stats, read));
+    WRITE_ONCE(rate, div64_u64((read - rate_bytes) * HZ, (u64) (now - rate_jiffies)) >> 20);
+
+    rate_jiffies = now;
+    rate_bytes = read;
+}
+
+#endif
@@ -26,7 +26,68 @@
 #include "lime.h"
 
 static struct socket *control;
-static struct socket *accept;
+static struct socket *conns[LIME_MAX_STREAMS];
+static int nconns;
+
+/* Guards the sockets above against abort_tcp() from another thread. */
+static DEFINE_MUTEX(sock_mutex);
+
+#ifdef LIME_SUPPORTS_THREADS
+/*
+ * Striped output.
+ *
+ * With more than one connection the output is cut into LIME_CHUNK_SIZE
+ * chunks, each sent as a frame (lime_stream_header followed by the
+ * payload) on connection seq % n.  Every connection has an ordered
+ * workqueue of its own so the streams send in parallel while frames on
+ * one connection stay in sequence.  Chunks live in a ring of 2n slots;
+ * the writer waits for a slot's frame to be sent before refilling it.
+ * A zero-length frame carrying the chunk count ends every connection.
+ */
+
+struct lime_frame {
+    struct work_struct work;
+    struct completion done;
+    struct socket *sock;
+    void *buf;
+    size_t len;
+    u64 seq;
+    ssize_t err;
+};
+
+static struct workqueue_struct *swq[LIME_MAX_STREAMS];
+static struct lime_frame *frames;
+static int nframes;
+
+static unsigned long head;  /* frame being filled */
+static unsigned long tail;  /* oldest frame not yet sent */
+#endif
+
+/*
+ * Make a new socket visible to abort_tcp().  Fails if the dump was
+ * cancelled first, as nothing would then wake a call blocked on it.
+ */
+static int track_sock(struct socket **slot, struct socket *sock) {
+    int r;
+
+    mutex_lock(&sock_mutex);
+    *slot = sock;
+    r = lime_cancelled() ? -ECANCELED : 0;
+    mutex_unlock(&sock_mutex);
+
+    return r;
+}
+
+static int track_conn(struct socket *sock) {
+    int r;
+
+    mutex_lock(&sock_mutex);
+    conns[nconns++] = sock;
+    r = lime_cancelled() ? -ECANCELED : 0;
+    mutex_unlock(&sock_mutex);
+
+    return r;
+}
 
 static int create_tcp_sock(struct socket **sock, int family) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
@@ -38,19 +99,186 @@ static int create_tcp_sock(struct socket **sock, int family) {
 #endif
 }
 
-int setup_tcp(void) {
+#ifdef LIME_SUPPORTS_THREADS
+static ssize_t send_all(struct socket *sock, void *v, size_t is) {
+    struct kvec iov;
+    struct msghdr msg;
+    ssize_t s, sent = 0;
+
+    while (sent < is) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = (u8 *) v + sent;
+        iov.iov_len = is - sent;
+
+        s = kernel_sendmsg(sock, &msg, &iov, 1, is - sent);
+        if (s == -EAGAIN || s == -EINTR)
+            continue;
+        if (s <= 0)
+            return (s < 0) ? s : -EPIPE;
+        sent += s;
+    }
+
+    return sent;
+}
+
+static ssize_t send_frame(struct socket *sock, void *v, size_t len, u64 seq) {
+    lime_stream_header header;
+    ssize_t s;
+
+    header.magic = LIME_STREAM_MAGIC;
+    header.length = len;
+    header.seq = seq;
+
+    if ((s = send_all(sock, &header, sizeof(header))) < 0)
+        return s;
+
+    return len ? send_all(sock, v, len) : 0;
+}
+
+static void frame_work(struct work_struct *work) {
+    struct lime_frame *f = container_of(work, struct lime_frame, work);
+
+    f->err = send_frame(f->sock, f->buf, f->len, f->seq);
+    complete(&f->done);
+}
+
+static void stripe_stop(void) {
+    int i;
+
+    for (i = 0; i < nconns; i++) {
+        if (swq[i]) {
+            destroy_workqueue(swq[i]);
+            swq[i] = NULL;
+        }
+    }
+
+    if (frames) {
+        for (i = 0; i < nframes; i++)
+            vfree(frames[i].buf);
+        kfree(frames);
+        frames = NULL;
+    }
+}
+
+static int stripe_start(void) {
+    int i;
+
+    nframes = nconns * 2;
+    frames = kcalloc(nframes, sizeof(*frames), GFP_KERNEL);
+    if (!frames)
+        goto fail;
+
+    for (i = 0; i < nconns; i++) {
+        swq[i] = alloc_ordered_workqueue("lime_stream%d", 0, i);
+        if (!swq[i])
+            goto fail;
+    }
+
+    for (i = 0; i < nframes; i++) {
+        frames[i].buf = vmalloc(LIME_CHUNK_SIZE);
+        if (!frames[i].buf)
+            goto fail;
+
+        INIT_WORK(&frames[i].work, frame_work);
+        init_completion(&frames[i].done);
+    }
+
+    head = tail = 0;
+
+    return 0;
+
+fail:
+    DBG("Failed to start stream senders");
+    stripe_stop();
+    return -ENOMEM;
+}
+
+/* Wait for the oldest frame still in flight. */
+static ssize_t stripe_drain(void) {
+    struct lime_frame *f = &frames[tail % nframes];
+
+    wait_for_completion(&f->done);
+    tail++;
+    f->len = 0;
+
+    return f->err;
+}
+
+static ssize_t stripe_submit(void) {
+    struct lime_frame *f = &frames[head % nframes];
+
+    f->sock = conns[head % nconns];
+    f->seq = head;
+    reinit_completion(&f->done);
+    queue_work(swq[head % nconns], &f->work);
+    head++;
+
+    /* The next slot to fill still holds the oldest frame. */
+    if (head - tail == nframes)
+        return stripe_drain();
+
+    return 0;
+}
+
+static ssize_t stripe_write(void *v, size_t is) {
+    struct lime_frame *f;
+    size_t n, done = 0;
+    ssize_t ret;
+
+    while (done < is) {
+        f = &frames[head % nframes];
+
+        n = min(is - done, LIME_CHUNK_SIZE - f->len);
+        memcpy((u8 *) f->buf + f->len, (u8 *) v + done, n);
+        f->len += n;
+        done += n;
+
+        if (f->len == LIME_CHUNK_SIZE && (ret = stripe_submit()) < 0)
+            return ret;
+    }
+
+    return is;
+}
+
+/* Send the partial chunk, wait for everything and end every stream. */
+static ssize_t stripe_flush(void) {
+    ssize_t ret, err = 0;
+    int i;
+
+    if (frames[head % nframes].len > 0 && (ret = stripe_submit()) < 0)
+        err = ret;
+
+    while (tail < head) {
+        ret = stripe_drain();
+        if (ret < 0 && !err)
+            err = ret;
+    }
+
+    for (i = 0; !err && i < nconns; i++)
+        if ((ret = send_frame(conns[i], NULL, 0, head)) < 0)
+            err = ret;
+
+    return err;
+}
+#endif
+
+static int accept_tcp(int n) {
     struct sockaddr_in saddr;
+    struct socket *sock;
     int r;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
     int opt = 1;
 #endif
 
-    r = create_tcp_sock(&control, AF_INET);
+    r = create_tcp_sock(&sock, AF_INET);
     if (r < 0) {
         DBG("Error creating control socket");
         return r;
     }
 
+    if ((r = track_sock(&control, sock)) < 0)
+        return r;
+
     memset(&saddr, 0, sizeof(saddr));
 
     saddr.sin_family = AF_INET;
@@ -82,34 +310,139 @@ int setup_tcp(void) {
         return r;
     }
 
-    r = kernel_listen(control,1);
+    r = kernel_listen(control, n);
     if (r) {
         DBG("Error listening on socket");
         return r;
     }
 
-    r = kernel_accept(control, &accept, 0);
+    while (nconns < n) {
+        r = kernel_accept(control, &sock, 0);
 
-    if (r < 0) {
-        DBG("Error accepting socket");
+        if (r < 0) {
+            DBG("Error accepting socket");
+            return r;
+        }
+
+        if ((r = track_conn(sock)) < 0)
+            return r;
+    }
+
+    return 0;
+}
+
+#ifdef LIME_SUPPORTS_VSOCK
+/* Connect out to a listener on the host (or any other CID). */
+static int connect_vsock(int n) {
+    struct sockaddr_vm vaddr;
+    struct socket *sock;
+    int r;
+
+    memset(&vaddr, 0, sizeof(vaddr));
+
+    vaddr.svm_family = AF_VSOCK;
+    vaddr.svm_cid = cid;
+    vaddr.svm_port = port;
+
+    while (nconns < n) {
+        r = sock_create_kern(&init_net, AF_VSOCK, SOCK_STREAM, 0, &sock);
+        if (r < 0) {
+            DBG("Error creating vsock socket");
+            return r;
+        }
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,19,0)
+        r = kernel_connect(sock, (struct sockaddr *) &vaddr, sizeof(vaddr), 0);
+#else
+        r = kernel_connect(sock, (struct sockaddr_unsized *) &vaddr, sizeof(vaddr), 0);
+#endif
+        if (r < 0) {
+            DBG("Error connecting to vsock %u:%d", cid, port);
+            sock_release(sock);
+            return r;
+        }
+
+        if ((r = track_conn(sock)) < 0)
+            return r;
+    }
+
+    return 0;
+}
+#endif
+
+int setup_tcp(int n) {
+    int r;
+
+    n = clamp(n, 1, LIME_MAX_STREAMS);
+
+#ifdef LIME_SUPPORTS_VSOCK
+    if (method == LIME_METHOD_VSOCK)
+        r = connect_vsock(n);
+    else
+#endif
+        r = accept_tcp(n);
+
+    if (r < 0)
         return r;
+
+#ifdef LIME_SUPPORTS_THREADS
+    if (nconns > 1) {
+        DBG("Striping output across %d connections", nconns);
+        return stripe_start();
     }
+#endif
 
     return 0;
 }
 
-void cleanup_tcp(void) {
-    if (accept) {
-        kernel_sock_shutdown(accept, SHUT_RDWR);
-        sock_release(accept);
-        accept = NULL;
+/* Close every connection; returns an error if striped output could not be finished. */
+int cleanup_tcp(void) {
+    int i, err = 0;
+
+#ifdef LIME_SUPPORTS_THREADS
+    if (frames) {
+        if ((err = stripe_flush()) < 0)
+            DBG("Error ending striped output: %d", err);
+        stripe_stop();
     }
+#endif
+
+    mutex_lock(&sock_mutex);
+
+    for (i = 0; i < nconns; i++) {
+        kernel_sock_shutdown(conns[i], SHUT_RDWR);
+        sock_release(conns[i]);
+        conns[i] = NULL;
+    }
+    nconns = 0;
 
     if (control) {
         kernel_sock_shutdown(control, SHUT_RDWR);
         sock_release(control);
         control = NULL;
     }
+
+    mutex_unlock(&sock_mutex);
+
+    return err;
+}
+
+/*
+ * Shut every socket down so that a dump blocked in kernel_accept() or
+ * a send returns an error.  Called on cancel, from outside the dump.
+ */
+void abort_tcp(void) {
+    int i;
+
+    mutex_lock(&sock_mutex);
+
+    for (i = 0; i < nconns; i++)
+        kernel_sock_shutdown(conns[i], SHUT_RDWR);
+
+    if (control)
+        kernel_sock_shutdown(control, SHUT_RDWR);
+
+    mutex_unlock(&sock_mutex);
 }
 
 ssize_t write_vaddr_tcp(void * v, size_t is) {
@@ -117,12 +450,67 @@ ssize_t write_vaddr_tcp(void * v, size_t is) {
     struct kvec iov;
     struct msghdr msg;
 
+#ifdef LIME_SUPPORTS_THREADS
+    if (frames)
+        return stripe_write(v, is);
+#endif
+
     memset(&msg, 0, sizeof(msg));
 
     iov.iov_base = v;
     iov.iov_len = is;
 
-    s = kernel_sendmsg(accept, &msg, &iov, 1, is);
+    s = kernel_sendmsg(conns[0], &msg, &iov, 1, is);
 
     return s;
 }
+
+#ifdef LIME_SUPPORTS_ZEROCOPY
+/*
+ * Hand whole pages to the socket without copying them first.  The
+ * socket takes its own page references, so the caller only has to make
+ * sure the pages pass sendpage_ok().
+ */
+ssize_t write_pages_tcp(struct page ** pages, unsigned int n) {
+    ssize_t s, sent = 0;
+    size_t len = (size_t) n * PAGE_SIZE;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+    struct bio_vec bvec[LIME_ZEROCOPY_BATCH];
+    struct msghdr msg;
+    unsigned int i;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_flags = MSG_SPLICE_PAGES;
+
+    for (i = 0; i < n; i++)
+        bvec_set_page(&bvec[i], pages[i], PAGE_SIZE, 0);
+
+    iov_iter_bvec(&msg.msg_iter, ITER_SOURCE, bvec, n, len);
+
+    /* A partial send has already advanced msg_iter; just resume. */
+    while (sent < len) {
+        s = sock_sendmsg(conns[0], &msg);
+        if (s == -EAGAIN || s == -EINTR)
+            continue;
+        if (s <= 0)
+            return (sent > 0) ? sent : s;
+        sent += s;
+    }
+#else
+    size_t off;
+
+    while (sent < len) {
+        off = sent & (PAGE_SIZE - 1);
+        s = kernel_sendpage(conns[0], pages[sent >> PAGE_SHIFT], off, PAGE_SIZE - off,
+                            (sent + PAGE_SIZE - off < len) ? MSG_MORE : 0);
+        if (s == -EAGAIN || s == -EINTR)
+            continue;
+        if (s <= 0)
+            return (sent > 0) ? sent : s;
+        sent += s;
+    }
+#endif
+
+    return sent;
+}
+#endif
@@ -0,0 +1,133 @@
+/*
+ * LiME - Linux Memory Extractor
+ * Copyright (c) 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ *
+ * Author:
+ * Joe T. Sylve, Ph.D.       - joe.sylve@gmail.com, @jtsylve
+ *
+ * SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "lime.h"
+
+#ifdef LIME_SUPPORTS_THROTTLE
+
+/*
+ * Rate and CPU limits for dumps on production machines.
+ *
+ * Output is metered by a token bucket that refills at max_rate MB/s and
+ * holds at most 100 ms of traffic, or one chunk if that is more.  The
+ * writer settles up once per LIME_CHUNK_SIZE written and sleeps while
+ * the bucket is in debt.
+ *
+ * With max_cpu each thread that copies memory checks, after each chunk,
+ * how much CPU time it used since the last check, and sleeps long
+ * enough to keep that under max_cpu percent of the elapsed time.
+ * Compression workers and the digest thread are paced by the threads
+ * that feed them.
+ */
+
+static u64 rate;
+static s64 burst;
+static s64 tokens;
+static u64 last;
+static size_t pending;
+static int cpu_pct;
+static struct lime_duty writer;
+
+static u64 now_ns(void) {
+    return ktime_to_ns(ktime_get());
+}
+
+/* Sleep for about ns, which latency budgets then leave out. */
+static void throttle_sleep(u64 ns) {
+    unsigned long us = div_u64(ns, NSEC_PER_USEC);
+    u64 start = now_ns();
+
+    if (us >= 20 * USEC_PER_MSEC)
+        msleep_interruptible(us / USEC_PER_MSEC);
+    else if (us)
+        usleep_range(us, us + us / 8 + 1);
+
+    budget_stall(now_ns() - start);
+}
+
+void throttle_begin(struct lime_duty *d) {
+    d->wall = now_ns();
+    d->cpu = current->se.sum_exec_runtime;
+}
+
+/* Sleep off the CPU time used since the last call beyond max_cpu. */
+void throttle_cpu(struct lime_duty *d) {
+    u64 busy, wall, want;
+
+    // Non-preemptible kernels get to run something else between chunks
+    cond_resched();
+
+    if (!cpu_pct)
+        return;
+
+    busy = current->se.sum_exec_runtime - d->cpu;
+    wall = now_ns() - d->wall;
+    want = div_u64(busy * 100, cpu_pct);
+
+    if (want > wall)
+        throttle_sleep(want - wall);
+
+    throttle_begin(d);
+}
+
+void throttle_start(int max_rate, int max_cpu) {
+    rate = (max_rate > 0) ? (u64) max_rate << 20 : 0;
+    burst = max_t(s64, LIME_CHUNK_SIZE, div_u64(rate, 10));
+    tokens = burst;
+    pending = 0;
+    cpu_pct = (max_cpu > 0 && max_cpu < 100) ? max_cpu : 0;
+    last = now_ns();
+    throttle_begin(&writer);
+
+    if (rate || cpu_pct)
+        DBG("Throttling to %d MB/s, %d%% CPU", max_rate, cpu_pct);
+}
+
+/* Account for n bytes written to the output. */
+void throttle_write(size_t n) {
+    u64 now;
+
+    if ((pending += n) < LIME_CHUNK_SIZE)
+        return;
+
+    throttle_cpu(&writer);
+
+    if (rate) {
+        now = now_ns();
+        // At most a second's refill, as the bucket holds less than that
+        tokens += div_u64(min_t(u64, now - last, NSEC_PER_SEC) * rate, NSEC_PER_SEC);
+        tokens = min(tokens, burst) - (s64) pending;
+        last = now;
+
+        if (tokens < 0) {
+            throttle_sleep(div_u64((u64) -tokens * NSEC_PER_SEC, rate));
+            throttle_begin(&writer);
+        }
+    }
+
+    pending = 0;
+}
+
+#endif
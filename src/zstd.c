@@ -0,0 +1,77 @@
+/*
+ * LiME - Linux Memory Extractor
+ * Copyright (c) 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ *
+ * Author:
+ * Joe T. Sylve, Ph.D.       - joe.sylve@gmail.com, @jtsylve
+ *
+ * SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "lime.h"
+
+#ifdef LIME_SUPPORTS_ZSTD
+#include <linux/zstd.h>
+
+/*
+ * Each chunk becomes one zstd frame.  Concatenated frames are a valid
+ * zstd stream, so the output decodes with zstd -d.  Parameters are sized
+ * for a full chunk so every frame fits the same workspace.
+ */
+#define ZSTD_LEVEL  3
+
+static zstd_parameters zstd_chunk_params(void)
+{
+    return zstd_get_params(ZSTD_LEVEL, LIME_CHUNK_SIZE);
+}
+
+int zstd_member_workspacesize(void)
+{
+    zstd_parameters params = zstd_chunk_params();
+
+    return zstd_cctx_workspace_bound(&params.cParams);
+}
+
+size_t zstd_member_bound(size_t inlen)
+{
+    return zstd_compress_bound(inlen);
+}
+
+ssize_t zstd_member(void *ws, const void *in, size_t inlen, void *out, size_t outlen)
+{
+    zstd_parameters params = zstd_chunk_params();
+    zstd_cctx *cctx;
+    size_t ret;
+
+    if (inlen > LIME_CHUNK_SIZE)
+        return -EINVAL;
+
+    cctx = zstd_init_cctx(ws, zstd_member_workspacesize());
+    if (!cctx)
+        return -EINVAL;
+
+    ret = zstd_compress_cctx(cctx, out, outlen, in, inlen, &params);
+    if (zstd_is_error(ret)) {
+        DBG("zstd error: %d", zstd_get_error_code(ret));
+        return -EIO;
+    }
+
+    return ret;
+}
+
+#endif
@@ -0,0 +1,80 @@
+#!/bin/bash
+# SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+# SPDX-License-Identifier: GPL-2.0-only
+# bench-cache.sh — Measure how much a dump disturbs a co-running workload.
+#
+# Runs a cache-sensitive workload on one CPU for a fixed time, five
+# times: alone, and next to a dump with lowcache=0 and lowcache=1, each
+# written directly and through a 64 MB buffer (bufsize=64).  perf counts
+# the workload's last-level cache loads and misses; stress-ng reports how
+# much work it got done.  The dump runs on another CPU and is written to
+# OUTPUT, /dev/null by default.  Give a file on a real disk to include the
+# cost of writeback, which a /dev/null sink leaves out.
+#
+# Usage: sudo ./test/bench-cache.sh <lime.ko> [seconds] [output]
+#
+# Needs perf and stress-ng, and at least two CPUs.  Pick a time longer
+# than a dump takes.  Run on an otherwise idle host; the numbers are only
+# comparable between runs on one machine.
+
+set -euo pipefail
+
+LIME_KO="${1:?Usage: $0 <lime.ko> [seconds] [output]}"
+SECS="${2:-30}"
+OUTPUT="${3:-/dev/null}"
+
+for cmd in perf stress-ng taskset insmod rmmod; do
+    if ! command -v "$cmd" >/dev/null 2>&1; then
+        echo "ERROR: $cmd not found" >&2
+        exit 1
+    fi
+done
+
+if [ "$(nproc)" -lt 2 ]; then
+    echo "ERROR: needs at least two CPUs" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d)
+trap "rmmod lime 2>/dev/null || true; rm -rf $WORK" EXIT
+
+# run <label> [lime parameters...] — empty parameters mean no dump
+run() {
+    local label="$1"; shift
+    local perf="$WORK/$label.perf" ops="$WORK/$label.ops"
+
+    taskset -c 1 perf stat -x, -e LLC-loads,LLC-load-misses -o "$perf" -- \
+        stress-ng --cache 1 --timeout "${SECS}s" --metrics-brief >"$ops" 2>&1 &
+    local pid=$!
+
+    local dump="-"
+    if [ $# -gt 0 ]; then
+        sleep 1
+        local start end
+        start=$(date +%s.%N)
+        taskset -c 0 insmod "$LIME_KO" "path=$OUTPUT" format=raw "$@"
+        end=$(date +%s.%N)
+        dump=$(awk -v s="$start" -v e="$end" 'BEGIN { printf "%.1f", e - s }')
+        rmmod lime
+        [ "$OUTPUT" = /dev/null ] || rm -f "$OUTPUT"
+    fi
+
+    wait $pid
+
+    local loads misses bogo
+    loads=$(awk -F, '$3 == "LLC-loads" {print $1}' "$perf")
+    misses=$(awk -F, '$3 == "LLC-load-misses" {print $1}' "$perf")
+    # stress-ng: metrc: [pid] cache <ops> <real> <usr> <sys> <ops/s real> <ops/s cpu>
+    bogo=$(awk '$4 == "cache" && $5 ~ /^[0-9]+$/ {print $9}' "$ops" | head -1)
+
+    printf "%-20s %10s %16s %16s %8s %14s\n" "$label" "$dump" "$loads" "$misses" \
+        "$(awk -v m="$misses" -v l="$loads" 'BEGIN { if (l > 0) printf "%.2f%%", 100 * m / l; else print "-" }')" \
+        "${bogo:--}"
+}
+
+printf "%-20s %10s %16s %16s %8s %14s\n" "run" "dump (s)" "LLC loads" "LLC misses" "miss %" "bogo ops/s"
+run "idle"
+run "lowcache=0" lowcache=0
+run "lowcache=1" lowcache=1
+run "lowcache=0 bufsize" lowcache=0 bufsize=64
+run "lowcache=1 bufsize" lowcache=1 bufsize=64
@@ -2,13 +2,16 @@
 # SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
 # SPDX-License-Identifier: GPL-2.0-only
 # build-initramfs.sh — Create a minimal initramfs for QEMU smoke testing.
-# Usage: ./test/build-initramfs.sh <lime.ko> <output.cpio.gz>
+# Usage: ./test/build-initramfs.sh <lime.ko> <output.cpio.gz> [init]
+#
+# init defaults to smoke-init; qemu-bench.sh passes bench-init.
 
 set -euo pipefail
 
 LIME_KO="${1:?Usage: $0 <lime.ko> <output.cpio.gz>}"
 OUTPUT="${2:?Usage: $0 <lime.ko> <output.cpio.gz>}"
 SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+INIT="${3:-$SCRIPT_DIR/smoke-init}"
 
 BUSYBOX=$(command -v busybox 2>/dev/null || echo /usr/bin/busybox)
 if [ ! -x "$BUSYBOX" ]; then
@@ -22,12 +25,30 @@ trap "rm -rf $WORK" EXIT
 mkdir -p "$WORK"/{bin,dev,proc,sys,tmp,lib/modules}
 
 cp "$BUSYBOX" "$WORK/bin/busybox"
-for cmd in sh mount umount ls cat wc od awk tr grep insmod rmmod poweroff; do
+for cmd in sh mount umount mkdir rm ls cat wc od awk tr grep cmp cut du sha256sum head tail gunzip insmod rmmod sleep ifconfig poweroff; do
     ln -s busybox "$WORK/bin/$cmd"
 done
 
 cp "$LIME_KO" "$WORK/lib/modules/lime.ko"
-cp "$SCRIPT_DIR/smoke-init" "$WORK/init"
+
+# mkfs.ext4 and its libraries for the prescan test; the check skips itself without it
+if MKFS=$(command -v mkfs.ext4); then
+    cp "$MKFS" "$WORK/bin/mkfs.ext4"
+    for lib in $(ldd "$MKFS" 2>/dev/null | awk '$1 ~ /^\// { print $1 } $3 ~ /^\// { print $3 }'); do
+        mkdir -p "$WORK$(dirname "$lib")"
+        cp -L "$lib" "$WORK$lib"
+    done
+else
+    echo "WARNING: mkfs.ext4 not found, prescan ext4 check will be skipped" >&2
+fi
+
+# Receiver for the vsock: test and TCP benchmarks; the test skips itself if this fails
+cc -static -O2 -pthread -o "$WORK/bin/lime-recv" "$SCRIPT_DIR/../tools/lime-recv.c" 2>/dev/null ||
+    echo "WARNING: could not build a static lime-recv, vsock test will be skipped" >&2
+# Patches and checks differential dumps; the delta test skips itself if this fails
+cc -static -O2 -o "$WORK/bin/lime-apply" "$SCRIPT_DIR/../tools/lime-apply.c" 2>/dev/null ||
+    echo "WARNING: could not build a static lime-apply, delta test will be skipped" >&2
+cp "$INIT" "$WORK/init"
 chmod +x "$WORK/init"
 
 (cd "$WORK" && find . | cpio -o -H newc --quiet) | gzip > "$OUTPUT"
@@ -21,23 +21,26 @@ echo "=== LiME Source Checks ==="
 ##    have matching extern declarations in lime.h.
 ##
 echo "--- Extern declarations ---"
-for f in "$SRC"/tcp.c "$SRC"/disk.c "$SRC"/hash.c "$SRC"/deflate.c; do
+for f in "$SRC"/tcp.c "$SRC"/disk.c "$SRC"/blk.c "$SRC"/hash.c "$SRC"/deflate.c "$SRC"/parallel.c "$SRC"/compress.c "$SRC"/lz4.c "$SRC"/zstd.c "$SRC"/merkle.c "$SRC"/stats.c "$SRC"/control.c "$SRC"/delta.c "$SRC"/dedup.c "$SRC"/budget.c "$SRC"/throttle.c "$SRC"/filter.c; do
     [ -f "$f" ] || continue
     base=$(basename "$f")
 
-    # Find function definitions at column 0 that aren't static or preprocessor
-    grep -n '^[a-zA-Z]' "$f" | grep -v '^[0-9]*:static ' | grep -v '^[0-9]*:#' |
-        grep '(' | while IFS=: read -r line content; do
-            # Extract the word immediately before the first (
-            func=$(echo "$content" | sed 's/(.*//' | awk '{print $NF}' | tr -d '* ')
-            [ -z "$func" ] && continue
-            # Skip obvious non-functions
-            case "$func" in if|while|for|switch|return|sizeof) continue ;; esac
-            # Check lime.h
-            if ! grep -q "extern.*${func} *(" "$SRC/lime.h"; then
-                err "$base:$line: '$func' missing extern in lime.h"
-            fi
-        done
+    # Find function definitions at column 0 that aren't static or preprocessor.
+    # The loop reads from a process substitution, not a pipe, so that err()
+    # counts in this shell rather than in a subshell.
+    while IFS=: read -r line content; do
+        # Extract the word immediately before the first (
+        func=$(echo "$content" | sed 's/(.*//' | awk '{print $NF}' | tr -d '* ')
+        [ -z "$func" ] && continue
+        # Skip obvious non-functions
+        case "$func" in if|while|for|switch|return|sizeof) continue ;; esac
+        # Skip macro invocations such as DEFINE_PER_CPU(...)
+        case "$func" in *[a-z]*) ;; *) continue ;; esac
+        # Check lime.h
+        if ! grep -q "extern.*${func} *(" "$SRC/lime.h"; then
+            err "$base:$line: '$func' missing extern in lime.h"
+        fi
+    done < <(grep -n '^[a-zA-Z]' "$f" | grep -v '^[0-9]*:static ' | grep -v '^[0-9]*:#' | grep '(' || true)
 done
 
 ##
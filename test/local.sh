@@ -10,6 +10,7 @@
 #   ./test/local.sh build [kernel] [config] [builds]
 #   ./test/local.sh analyze
 #   ./test/local.sh smoke [kernel]
+#   ./test/local.sh bench [kernel] [qemu-bench.sh options]
 #   ./test/local.sh all
 #   ./test/local.sh clean
 #   ./test/local.sh shell
@@ -97,6 +98,15 @@ if [ -n "${LIME_IN_DOCKER:-}" ]; then
             bash /src/test/qemu-smoke-test.sh "$KDIR" /tmp/build/lime-*.ko
             ;;
 
+        bench)
+            kernel="${1:-6.6}"; shift || true
+            prepare_cached "$kernel" qemu
+            setup_build
+            make -C /tmp/build KDIR="$KDIR"
+            # JSON results go to stdout; the source mount is read-only
+            bash /src/test/qemu-bench.sh "$@" "$KDIR" /tmp/build/lime-*.ko
+            ;;
+
         *)  echo "Unknown container command: $cmd"; exit 1 ;;
     esac
     exit 0
@@ -136,7 +146,7 @@ drun() {
 }
 
 case "${1:-help}" in
-    build|analyze|smoke)
+    build|analyze|smoke|bench)
         ensure_image; ensure_volume
         drun "$@"
         ;;
@@ -195,6 +205,7 @@ Commands:
   build [kernel] [config] [builds]   Compile test
   analyze                            Sparse + source checks
   smoke [kernel]                     QEMU runtime test
+  bench [kernel] [options]           QEMU throughput benchmark (JSON)
   all                                Full CI matrix
   clean                              Remove Docker image and cache
   shell                              Interactive shell in container
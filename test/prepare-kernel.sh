@@ -97,6 +97,17 @@ case "$CONFIG" in
         scripts/config --enable CONFIG_RD_GZIP
         scripts/config --enable CONFIG_ZLIB_DEFLATE
         scripts/config --enable CONFIG_ZLIB_INFLATE
+        # Virtio disk for blk: output in the smoke test and disk output in qemu-bench.sh
+        scripts/config --enable CONFIG_VIRTIO_PCI
+        scripts/config --enable CONFIG_VIRTIO_MMIO
+        scripts/config --enable CONFIG_VIRTIO_BLK
+        # ext4 on the virtio disk for the prescan reservation check
+        scripts/config --enable CONFIG_EXT4_FS
+        # vsock: output, looped back inside the guest
+        scripts/config --enable CONFIG_VSOCKETS
+        scripts/config --enable CONFIG_VSOCKETS_LOOPBACK
+        # xxh64 for fingerprint=; the library symbol has no prompt
+        scripts/config --enable CONFIG_CRYPTO_XXHASH
         ;;
     *)
         echo "ERROR: Unknown config '${CONFIG}'" >&2
@@ -0,0 +1,223 @@
+#!/bin/bash
+# SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+# SPDX-License-Identifier: GPL-2.0-only
+# qemu-bench.sh — Measure LiME throughput in QEMU across a parameter matrix.
+# Supports x86_64, aarch64, arm, and riscv64.
+#
+# Usage: ./test/qemu-bench.sh [options] <kernel-dir> <lime.ko>
+#
+#   -m SIZE       guest RAM, backed by a file in MEMDIR (default 2G)
+#   -c N          vCPUs (default 2)
+#   -d DIR        directory for the RAM backing file (default /dev/shm)
+#   -o FILE       write the JSON results to FILE (default stdout)
+#   -b FILE       compare against an earlier results file
+#   -t PERCENT    regression threshold against -b (default 10)
+#   -T SECONDS    give up on the VM after this long (default 3600)
+#   -F LIST       formats (default raw,padded,lime,lime2)
+#   -C LIST       compress values, or none (default none,deflate)
+#   -D LIST       digest values, or none (default none,sha256)
+#   -I LIST       dio values, disk only (default 0,1)
+#   -O LIST       outputs, disk and/or tcp (default disk,tcp)
+#   -r N          dumps per combination (default 3)
+#
+# Every combination is dumped N times and the median time is reported;
+# throughput is memory read per second of that time.  A dump is timed
+# from its first range read until its output is finished, as reported by
+# the dump_ms stat, so loading the module is not counted.  Disk output
+# goes to a virtio disk backed by a sparse file, TCP output to a receiver
+# inside the guest.  The exit status is 1 if any dump fails or a case is
+# more than PERCENT slower than in the baseline, and 2 if the VM does not
+# finish.  Only compare results from the same host, memory size and vCPU
+# count.
+
+set -euo pipefail
+
+MEM=2G
+CPUS=2
+MEMDIR=/dev/shm
+OUT=
+BASELINE=
+THRESHOLD=10
+TIMEOUT=3600
+FORMATS=raw,padded,lime,lime2
+COMPRESS=none,deflate
+DIGESTS=none,sha256
+DIOS=0,1
+OUTPUTS=disk,tcp
+RUNS=3
+
+while getopts "m:c:d:o:b:t:T:F:C:D:I:O:r:" opt; do
+    case "$opt" in
+        m) MEM="$OPTARG" ;;
+        c) CPUS="$OPTARG" ;;
+        d) MEMDIR="$OPTARG" ;;
+        o) OUT="$OPTARG" ;;
+        b) BASELINE="$OPTARG" ;;
+        t) THRESHOLD="$OPTARG" ;;
+        T) TIMEOUT="$OPTARG" ;;
+        F) FORMATS="$OPTARG" ;;
+        C) COMPRESS="$OPTARG" ;;
+        D) DIGESTS="$OPTARG" ;;
+        I) DIOS="$OPTARG" ;;
+        O) OUTPUTS="$OPTARG" ;;
+        r) RUNS="$OPTARG" ;;
+        *) sed -n '7,21p' "$0" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+KDIR="${1:?Usage: $0 [options] <kernel-dir> <lime.ko>}"
+LIME_KO="${2:?Usage: $0 [options] <kernel-dir> <lime.ko>}"
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+
+# Architecture-specific QEMU configuration
+case "$(uname -m)" in
+    x86_64)
+        QEMU_BIN=qemu-system-x86_64
+        QEMU_MACHINE="-cpu max"
+        KERNEL_IMAGE="$KDIR/arch/x86/boot/bzImage"
+        CONSOLE=ttyS0
+        ;;
+    aarch64)
+        QEMU_BIN=qemu-system-aarch64
+        QEMU_MACHINE="-M virt -cpu max"
+        KERNEL_IMAGE="$KDIR/arch/arm64/boot/Image"
+        CONSOLE=ttyAMA0
+        ;;
+    armv7l|armhf)
+        QEMU_BIN=qemu-system-arm
+        QEMU_MACHINE="-M virt"
+        KERNEL_IMAGE="$KDIR/arch/arm/boot/zImage"
+        CONSOLE=ttyAMA0
+        ;;
+    riscv64)
+        QEMU_BIN=qemu-system-riscv64
+        QEMU_MACHINE="-M virt -bios none"
+        KERNEL_IMAGE="$KDIR/arch/riscv/boot/Image"
+        CONSOLE=ttyS0
+        ;;
+    *)
+        echo "ERROR: Unsupported architecture $(uname -m)" >&2
+        exit 1
+        ;;
+esac
+
+if [ ! -f "$KERNEL_IMAGE" ]; then
+    echo "ERROR: $KERNEL_IMAGE not found" >&2
+    exit 1
+fi
+
+if ! command -v "$QEMU_BIN" >/dev/null 2>&1; then
+    echo "ERROR: $QEMU_BIN not found (install the appropriate qemu-system package)" >&2
+    exit 1
+fi
+
+if [ -n "$BASELINE" ] && [ ! -f "$BASELINE" ]; then
+    echo "ERROR: baseline $BASELINE not found" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d)
+trap "rm -rf $WORK" EXIT
+
+bash "$SCRIPT_DIR/build-initramfs.sh" "$LIME_KO" "$WORK/initramfs.cpio.gz" "$SCRIPT_DIR/bench-init"
+
+# Room for padded output, which spans the holes below 4 GB and beyond
+MEM_MB=$(numfmt --from=iec "$MEM" | awk '{print int($1 / 1048576)}')
+truncate -s "$((MEM_MB * 2 + 4096))M" "$WORK/disk.img"
+
+echo "==> Benchmarking in QEMU ($(uname -m)), $MEM RAM, $CPUS vCPUs" >&2
+echo "    Kernel:    $KERNEL_IMAGE" >&2
+echo "    Formats:   $FORMATS" >&2
+echo "    Compress:  $COMPRESS" >&2
+echo "    Digest:    $DIGESTS" >&2
+echo "    Dio:       $DIOS" >&2
+echo "    Outputs:   $OUTPUTS" >&2
+echo "    Runs:      $RUNS" >&2
+
+timeout "$TIMEOUT" $QEMU_BIN \
+    $QEMU_MACHINE \
+    -object memory-backend-file,id=ram,size="$MEM",mem-path="$MEMDIR",share=on \
+    -machine memory-backend=ram \
+    -m "$MEM" \
+    -smp "$CPUS" \
+    -drive file="$WORK/disk.img",format=raw,if=virtio \
+    -kernel "$KERNEL_IMAGE" \
+    -initrd "$WORK/initramfs.cpio.gz" \
+    -append "console=$CONSOLE panic=-1 quiet loglevel=4 bench_formats=$FORMATS bench_compress=$COMPRESS bench_digest=$DIGESTS bench_dio=$DIOS bench_outputs=$OUTPUTS bench_runs=$RUNS" \
+    -nographic \
+    -no-reboot \
+    > "$WORK/log" 2>&1 || true
+
+tr -d '\r' < "$WORK/log" > "$WORK/console"
+
+if ! grep -q "=== BENCH_COMPLETE ===" "$WORK/console"; then
+    echo "==> VM did not complete — full log:" >&2
+    tail -40 "$WORK/console" >&2
+    exit 2
+fi
+
+grep "^BENCH_ERROR" "$WORK/console" >&2 || true
+
+# One result object per line, so baselines can be read back with awk
+{
+    echo "{"
+    echo "  \"kernel\": \"$(awk '/^BENCH_KERNEL/ {print $2}' "$WORK/console")\","
+    echo "  \"arch\": \"$(uname -m)\","
+    echo "  \"memory\": \"$MEM\","
+    echo "  \"cpus\": $CPUS,"
+    echo "  \"results\": ["
+    sed -n 's/^BENCH_RESULT //p' "$WORK/console" | sed '$!s/$/,/; s/^/    /'
+    echo "  ]"
+    echo "}"
+} > "$WORK/results.json"
+
+if [ -n "$OUT" ]; then
+    cp "$WORK/results.json" "$OUT"
+    echo "==> Results written to $OUT" >&2
+else
+    cat "$WORK/results.json"
+fi
+
+# Summary table, and a line per regression against the baseline
+STATUS=0
+awk -v threshold="$THRESHOLD" '
+    function field(line, key,    re, v) {
+        re = "\"" key "\":\"?[^,\"}]*"
+        if (!match(line, re))
+            return ""
+        v = substr(line, RSTART + length(key) + 3, RLENGTH - length(key) - 3)
+        gsub(/"/, "", v)
+        return v
+    }
+    FILENAME == ARGV[1] {
+        if (/"case"/)
+            base[field($0, "case")] = field($0, "mb_per_sec")
+        next
+    }
+    /"case"/ {
+        name = field($0, "case")
+        rate = field($0, "mb_per_sec")
+        note = ""
+        if (field($0, "ok") != "true") {
+            note = "FAILED"
+            bad++
+        } else if (name in base && base[name] > 0) {
+            change = 100 * (rate - base[name]) / base[name]
+            note = sprintf("%+.1f%%", change)
+            if (change < -threshold) {
+                note = note " REGRESSION"
+                bad++
+            }
+        }
+        printf "%-36s %10s MB/s  %s\n", name, rate, note
+    }
+    END { exit bad > 0 }
+' "${BASELINE:-/dev/null}" "$WORK/results.json" >&2 || STATUS=1
+
+if [ $STATUS -ne 0 ]; then
+    echo "==> Benchmark FAILED (failed dumps or regressions over ${THRESHOLD}%)" >&2
+else
+    echo "==> Benchmark passed" >&2
+fi
+exit $STATUS
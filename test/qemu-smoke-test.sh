@@ -16,7 +16,10 @@ SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
 case "$(uname -m)" in
     x86_64)
         QEMU_BIN=qemu-system-x86_64
-        QEMU_MACHINE="-cpu max"
+        # Two NUMA nodes, one CPU and half the memory each, for numa=1
+        QEMU_MACHINE="-cpu max \
+            -object memory-backend-ram,id=m0,size=128M -numa node,nodeid=0,cpus=0,memdev=m0 \
+            -object memory-backend-ram,id=m1,size=128M -numa node,nodeid=1,cpus=1,memdev=m1"
         KERNEL_IMAGE="$KDIR/arch/x86/boot/bzImage"
         CONSOLE=ttyS0
         ;;
@@ -56,7 +59,11 @@ fi
 
 INITRAMFS=$(mktemp --suffix=.cpio.gz)
 LOG=$(mktemp)
-trap "rm -f $INITRAMFS $LOG" EXIT
+DISK=$(mktemp --suffix=.img)
+trap "rm -f $INITRAMFS $LOG $DISK" EXIT
+
+# Sparse scratch disk for blk: output, with room for a dump of all RAM
+truncate -s 512M "$DISK"
 
 bash "$SCRIPT_DIR/build-initramfs.sh" "$LIME_KO" "$INITRAMFS"
 
@@ -70,6 +77,7 @@ timeout 180 $QEMU_BIN \
     $QEMU_MACHINE \
     -kernel "$KERNEL_IMAGE" \
     -initrd "$INITRAMFS" \
+    -drive file="$DISK",format=raw,if=virtio \
     -append "console=$CONSOLE panic=-1 quiet loglevel=4" \
     -nographic \
     -no-reboot \
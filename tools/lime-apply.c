@@ -0,0 +1,428 @@
+/*
+ * LiME - Linux Memory Extractor
+ * Copyright (c) 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ *
+ * SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * lime-apply — patch a differential dump (baseline=) into the image it
+ * was taken against.
+ *
+ *   cc -O2 -o lime-apply tools/lime-apply.c
+ *   lime-apply <image.lime> <delta.lime>
+ *   lime-apply -c <image.lime> <table.fp>
+ *
+ * The image is modified in place and must be an uncompressed format=lime
+ * file whose ranges hold their data, such as the first capture taken
+ * with fingerprint=1.  Lime records in the delta are copied over it,
+ * fill records are expanded, and dedup records copy the page they refer
+ * to, which by then holds the referenced content.  Afterwards the image
+ * matches the memory the delta was taken from, and the delta's .fp
+ * table describes it: if <delta.lime>.fp exists, every page it has a
+ * hash for is checked against the patched image.
+ *
+ * With -c nothing is applied; the image is only checked against the
+ * table, which must come from the capture the image holds (or a delta
+ * applied to it).  The exit status is 1 if any page differs.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define LIME_MAGIC 0x4C694D45
+#define LIME_FILL_MAGIC 0x4C694D46
+#define LIME_DEDUP_MAGIC 0x4C694D44
+#define LIME_FP_MAGIC 0x4C694D48
+
+struct lime_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t s_addr;
+    uint64_t e_addr;
+    uint8_t reserved[8];
+} __attribute__ ((__packed__));
+
+struct fp_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t nranges;
+    uint64_t npages;
+    uint8_t reserved[8];
+} __attribute__ ((__packed__));
+
+struct fp_range {
+    uint64_t s_pfn;
+    uint64_t npages;
+} __attribute__ ((__packed__));
+
+struct range {
+    uint64_t start;
+    uint64_t end;
+    off_t offset;
+};
+
+static struct range *ranges;
+static size_t nranges;
+
+static char buf[1 << 20];
+
+static int read_full(int fd, void *p, size_t len) {
+    size_t got = 0;
+    ssize_t r;
+
+    while (got < len) {
+        r = read(fd, (char *) p + got, len - got);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return (r == 0 && got == 0) ? 1 : -1;
+        got += r;
+    }
+
+    return 0;
+}
+
+/* Map out where each range's data lives in the image. */
+static int load_image(int fd) {
+    struct lime_header h;
+    off_t pos = 0;
+    struct range *r;
+    int ret;
+
+    while ((ret = read_full(fd, &h, sizeof(h))) == 0) {
+        pos += sizeof(h);
+
+        if (h.magic == LIME_FILL_MAGIC)
+            continue;
+        if (h.magic != LIME_MAGIC || h.e_addr < h.s_addr) {
+            fprintf(stderr, "lime-apply: image is not an uncompressed lime file\n");
+            return -1;
+        }
+
+        r = realloc(ranges, (nranges + 1) * sizeof(*r));
+        if (!r)
+            return -1;
+        ranges = r;
+        r += nranges++;
+        r->start = h.s_addr;
+        r->end = h.e_addr;
+        r->offset = pos;
+
+        pos += h.e_addr - h.s_addr + 1;
+        if (lseek(fd, pos, SEEK_SET) < 0)
+            return -1;
+    }
+
+    return (ret < 0) ? -1 : 0;
+}
+
+/* Image offset of addr and how many bytes from there are stored. */
+static off_t lookup(uint64_t addr, uint64_t *avail) {
+    size_t i;
+
+    for (i = 0; i < nranges; i++) {
+        if (addr >= ranges[i].start && addr <= ranges[i].end) {
+            *avail = ranges[i].end - addr + 1;
+            return ranges[i].offset + (off_t) (addr - ranges[i].start);
+        }
+    }
+
+    return -1;
+}
+
+/* Read len bytes of the physical range at addr from the image. */
+static int fetch(int fd, uint64_t addr, char *p, uint64_t len) {
+    uint64_t avail, n;
+    off_t off;
+
+    while (len) {
+        off = lookup(addr, &avail);
+        if (off < 0) {
+            fprintf(stderr, "lime-apply: 0x%llx is not in the image\n", (unsigned long long) addr);
+            return -1;
+        }
+
+        n = (len < avail) ? len : avail;
+        if (pread(fd, p, n, off) != (ssize_t) n) {
+            perror("lime-apply: read");
+            return -1;
+        }
+
+        addr += n;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Write len bytes for the physical range at addr into the image. */
+static int patch(int fd, uint64_t addr, const char *p, uint64_t len) {
+    uint64_t avail, n;
+    off_t off;
+
+    while (len) {
+        off = lookup(addr, &avail);
+        if (off < 0) {
+            fprintf(stderr, "lime-apply: 0x%llx is not in the image\n", (unsigned long long) addr);
+            return -1;
+        }
+
+        n = (len < avail) ? len : avail;
+        if (pwrite(fd, p, n, off) != (ssize_t) n) {
+            perror("lime-apply: write");
+            return -1;
+        }
+
+        addr += n;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    return rotl64(acc + input * PRIME64_2, 31) * PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    return (acc ^ xxh64_round(0, val)) * PRIME64_1 + PRIME64_4;
+}
+
+/* xxh64 as the kernel's lib/xxhash.c computes it, on a little-endian host. */
+static uint64_t xxh64(const void *input, size_t len, uint64_t seed) {
+    const uint8_t *p = input, *end = p + len;
+    uint64_t v1, v2, v3, v4, h, k;
+    uint32_t w;
+
+    if (len >= 32) {
+        v1 = seed + PRIME64_1 + PRIME64_2;
+        v2 = seed + PRIME64_2;
+        v3 = seed;
+        v4 = seed - PRIME64_1;
+
+        for (; p + 32 <= end; p += 32) {
+            memcpy(&k, p, 8);
+            v1 = xxh64_round(v1, k);
+            memcpy(&k, p + 8, 8);
+            v2 = xxh64_round(v2, k);
+            memcpy(&k, p + 16, 8);
+            v3 = xxh64_round(v3, k);
+            memcpy(&k, p + 24, 8);
+            v4 = xxh64_round(v4, k);
+        }
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        memcpy(&k, p, 8);
+        h = rotl64(h ^ xxh64_round(0, k), 27) * PRIME64_1 + PRIME64_4;
+    }
+
+    if (p + 4 <= end) {
+        memcpy(&w, p, 4);
+        h = rotl64(h ^ (uint64_t) w * PRIME64_1, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    for (; p < end; p++)
+        h = rotl64(h ^ *p * PRIME64_5, 11) * PRIME64_1;
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/*
+ * Check every page the fingerprint table has a hash for against the
+ * image.  Returns the number of pages that differ, or -1 on error.
+ */
+static long check(int img, const char *file) {
+    struct fp_header h;
+    struct fp_range *r;
+    uint64_t i, j, hash, addr, avail;
+    unsigned long checked = 0;
+    long bad = 0;
+    off_t off;
+    int fd;
+
+    if ((fd = open(file, O_RDONLY)) < 0) {
+        perror(file);
+        return -1;
+    }
+
+    if (read_full(fd, &h, sizeof(h)) != 0 || h.magic != LIME_FP_MAGIC || h.version != 1 ||
+        !h.page_size || h.page_size > sizeof(buf)) {
+        fprintf(stderr, "lime-apply: %s is not a fingerprint table\n", file);
+        return -1;
+    }
+
+    r = calloc(h.nranges ? h.nranges : 1, sizeof(*r));
+    if (!r || (h.nranges && read_full(fd, r, h.nranges * sizeof(*r)) != 0)) {
+        fprintf(stderr, "lime-apply: %s is truncated\n", file);
+        return -1;
+    }
+
+    for (i = 0; i < h.nranges; i++) {
+        for (j = 0; j < r[i].npages; j++) {
+            if (read_full(fd, &hash, sizeof(hash)) != 0) {
+                fprintf(stderr, "lime-apply: %s is truncated\n", file);
+                return -1;
+            }
+
+            // A zero entry is a page that was not read
+            if (!hash)
+                continue;
+
+            addr = (r[i].s_pfn + j) * h.page_size;
+            off = lookup(addr, &avail);
+            if (off < 0 || avail < h.page_size || pread(img, buf, h.page_size, off) != h.page_size) {
+                fprintf(stderr, "lime-apply: page 0x%llx is not in the image\n", (unsigned long long) addr);
+                return -1;
+            }
+
+            if (xxh64(buf, h.page_size, 0) != hash) {
+                if (bad++ < 10)
+                    fprintf(stderr, "lime-apply: page 0x%llx differs\n", (unsigned long long) addr);
+            }
+            checked++;
+        }
+    }
+
+    free(r);
+    close(fd);
+
+    fprintf(stderr, "lime-apply: %lu pages checked against %s, %ld differ\n", checked, file, bad);
+    return bad;
+}
+
+int main(int argc, char **argv) {
+    struct lime_header h;
+    uint64_t addr, len, n, i, src;
+    unsigned long records = 0;
+    char *fp;
+    int img, delta, ret;
+    long bad;
+
+    if (argc == 4 && !strcmp(argv[1], "-c")) {
+        if ((img = open(argv[2], O_RDONLY)) < 0) {
+            perror(argv[2]);
+            return 1;
+        }
+        if (load_image(img) < 0)
+            return 1;
+        return (check(img, argv[3]) == 0) ? 0 : 1;
+    }
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <image.lime> <delta.lime>\n", argv[0]);
+        fprintf(stderr, "       %s -c <image.lime> <table.fp>\n", argv[0]);
+        return 2;
+    }
+
+    if ((img = open(argv[1], O_RDWR)) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    if ((delta = open(argv[2], O_RDONLY)) < 0) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    if (load_image(img) < 0)
+        return 1;
+
+    while ((ret = read_full(delta, &h, sizeof(h))) == 0) {
+        if ((h.magic != LIME_MAGIC && h.magic != LIME_FILL_MAGIC && h.magic != LIME_DEDUP_MAGIC) ||
+            h.e_addr < h.s_addr) {
+            fprintf(stderr, "lime-apply: bad record in delta\n");
+            return 1;
+        }
+
+        // A fill record repeats the 8 bytes in its reserved field
+        if (h.magic == LIME_FILL_MAGIC)
+            for (i = 0; i < sizeof(buf); i += sizeof(h.reserved))
+                memcpy(buf + i, h.reserved, sizeof(h.reserved));
+
+        // A dedup record names the address it repeats in the same field
+        memcpy(&src, h.reserved, sizeof(src));
+
+        for (addr = h.s_addr, len = h.e_addr - h.s_addr + 1; len; addr += n, src += n, len -= n) {
+            n = (len < sizeof(buf)) ? len : sizeof(buf);
+            if (h.magic == LIME_MAGIC && read_full(delta, buf, n) != 0) {
+                fprintf(stderr, "lime-apply: delta is truncated\n");
+                return 1;
+            }
+            if (h.magic == LIME_DEDUP_MAGIC && fetch(img, src, buf, n) < 0)
+                return 1;
+            if (patch(img, addr, buf, n) < 0)
+                return 1;
+        }
+
+        records++;
+    }
+
+    if (ret < 0) {
+        fprintf(stderr, "lime-apply: delta is truncated\n");
+        return 1;
+    }
+
+    if (fsync(img)) {
+        perror("lime-apply: fsync");
+        return 1;
+    }
+
+    fprintf(stderr, "lime-apply: %lu records applied\n", records);
+
+    // The delta's own table describes the patched image
+    fp = malloc(strlen(argv[2]) + sizeof(".fp"));
+    if (!fp)
+        return 1;
+    sprintf(fp, "%s.fp", argv[2]);
+
+    bad = 0;
+    if (access(fp, F_OK) == 0 && (bad = check(img, fp)) != 0)
+        return 1;
+
+    free(fp);
+
+    if (close(img)) {
+        perror("lime-apply: close");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,288 @@
+/*
+ * LiME - Linux Memory Extractor
+ * Copyright (c) 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ *
+ * SPDX-FileCopyrightText: 2011-2026 Joe T. Sylve, Ph.D. <joe.sylve@gmail.com>
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * lime-recv — receive a dump striped across several connections
+ * (streams=N) and write it out in order.
+ *
+ *   cc -O2 -pthread -o lime-recv tools/lime-recv.c
+ *   lime-recv <target-ip> <port> <streams> [output]
+ *   lime-recv vsock <port> <streams> [output]
+ *
+ * The first form connects to path=tcp:<port>; the second listens for
+ * path=vsock:<cid>:<port> on any CID.  With one stream the data is
+ * copied as is, as with netcat.
+ *
+ * Every connection carries frames of a 16-byte header (magic "LiMS",
+ * payload length, chunk sequence number) followed by the payload.  A
+ * zero-length frame ends a connection and carries the chunk count, so a
+ * dump that stops short is reported instead of silently truncated.
+ * Headers use the target's byte order, like the lime format itself.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/vm_sockets.h>
+
+#define LIME_STREAM_MAGIC 0x4C694D53
+#define MAX_STREAMS 16
+
+struct frame_header {
+    uint32_t magic;
+    uint32_t length;
+    uint64_t seq;
+} __attribute__ ((__packed__));
+
+struct chunk {
+    void *buf;
+    uint32_t len;
+    uint64_t seq;
+    int full;
+};
+
+static struct chunk *window;
+static unsigned long nwindow;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t next_seq;
+static uint64_t total = UINT64_MAX;
+static int running;
+static int failed;
+
+static int read_full(int fd, void *buf, size_t len) {
+    size_t got = 0;
+    ssize_t r;
+
+    while (got < len) {
+        r = read(fd, (char *) buf + got, len - got);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        got += r;
+    }
+
+    return 0;
+}
+
+static void *reader(void *arg) {
+    int fd = (int) (intptr_t) arg;
+    struct frame_header h;
+    struct chunk *c;
+    void *buf;
+
+    for (;;) {
+        if (read_full(fd, &h, sizeof(h)) < 0 || h.magic != LIME_STREAM_MAGIC) {
+            fprintf(stderr, "lime-recv: bad or missing frame header\n");
+            goto fail;
+        }
+
+        if (h.length == 0) {
+            pthread_mutex_lock(&lock);
+            if (total != UINT64_MAX && total != h.seq)
+                failed = 1;
+            total = h.seq;
+            break;
+        }
+
+        if (!(buf = malloc(h.length)) || read_full(fd, buf, h.length) < 0) {
+            fprintf(stderr, "lime-recv: short frame %llu\n", (unsigned long long) h.seq);
+            free(buf);
+            goto fail;
+        }
+
+        // Hold the chunk until it fits in the reorder window
+        pthread_mutex_lock(&lock);
+        while (h.seq >= next_seq + nwindow && !failed)
+            pthread_cond_wait(&cond, &lock);
+
+        if (failed) {
+            pthread_mutex_unlock(&lock);
+            free(buf);
+            goto fail;
+        }
+
+        c = &window[h.seq % nwindow];
+        c->buf = buf;
+        c->len = h.length;
+        c->seq = h.seq;
+        c->full = 1;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+    }
+
+    running--;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    close(fd);
+    return NULL;
+
+fail:
+    pthread_mutex_lock(&lock);
+    failed = 1;
+    running--;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    close(fd);
+    return NULL;
+}
+
+static int connect_to(const char *host, const char *port) {
+    struct addrinfo hints, *res, *ai;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, port, &hints, &res))
+        return -1;
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+            break;
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int listen_vsock(const char *port, int n) {
+    struct sockaddr_vm addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.svm_family = AF_VSOCK;
+    addr.svm_cid = VMADDR_CID_ANY;
+    addr.svm_port = atoi(port);
+
+    fd = socket(AF_VSOCK, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, n)) {
+        perror("lime-recv: vsock");
+        return -1;
+    }
+
+    return fd;
+}
+
+/* A single stream carries the dump unframed. */
+static int copy_plain(int fd, FILE *out) {
+    static char buf[1 << 16];
+    ssize_t r;
+
+    while ((r = read(fd, buf, sizeof(buf))) != 0) {
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 || fwrite(buf, 1, r, out) != (size_t) r) {
+            perror("lime-recv");
+            return 1;
+        }
+    }
+
+    close(fd);
+    return fclose(out) ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    pthread_t threads[MAX_STREAMS];
+    struct chunk *c;
+    FILE *out = stdout;
+    int i, n, fd, lfd = -1;
+
+    if (argc < 4 || argc > 5) {
+        fprintf(stderr, "usage: %s <host>|vsock <port> <streams> [output]\n", argv[0]);
+        return 2;
+    }
+
+    n = atoi(argv[3]);
+    if (n < 1 || n > MAX_STREAMS) {
+        fprintf(stderr, "lime-recv: streams must be 1-%d\n", MAX_STREAMS);
+        return 2;
+    }
+
+    if (argc == 5 && !(out = fopen(argv[4], "wb"))) {
+        perror(argv[4]);
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "vsock") && (lfd = listen_vsock(argv[2], n)) < 0)
+        return 1;
+
+    nwindow = n * 4;
+    window = calloc(nwindow, sizeof(*window));
+    if (!window)
+        return 1;
+
+    // LiME takes the connections in order; all must be up before data flows
+    for (i = 0; i < n; i++) {
+        fd = (lfd >= 0) ? accept(lfd, NULL, NULL) : connect_to(argv[1], argv[2]);
+        if (fd < 0) {
+            fprintf(stderr, "lime-recv: cannot connect to %s:%s\n", argv[1], argv[2]);
+            return 1;
+        }
+        if (n == 1)
+            return copy_plain(fd, out);
+        running++;
+        pthread_create(&threads[i], NULL, reader, (void *) (intptr_t) fd);
+    }
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        c = &window[next_seq % nwindow];
+
+        if (c->full && c->seq == next_seq) {
+            pthread_mutex_unlock(&lock);
+            if (fwrite(c->buf, 1, c->len, out) != c->len) {
+                perror("lime-recv: write");
+                return 1;
+            }
+            free(c->buf);
+            pthread_mutex_lock(&lock);
+
+            c->full = 0;
+            next_seq++;
+            pthread_cond_broadcast(&cond);
+            continue;
+        }
+
+        if (failed || !running)
+            break;
+
+        pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+
+    if (fclose(out)) {
+        perror("lime-recv: close");
+        return 1;
+    }
+
+    if (failed || next_seq != total) {
+        fprintf(stderr, "lime-recv: incomplete dump, %llu chunks received\n",
+                (unsigned long long) next_seq);
+        return 1;
+    }
+
+    fprintf(stderr, "lime-recv: %llu chunks received\n", (unsigned long long) next_seq);
+    return 0;
+}